@@ -6,22 +6,38 @@
 #include <algorithm>
 #include <cassert>
 #include <cstdlib>
+#include <exception>
 #include <numeric>
 #include <random>
 #include <string>
+#include <tuple>
 #include <cmath>
+#include <cstring>
+
+#if defined(NO_SIMD)
+// Scalar kernels only, to check the SIMD ones against
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_SSE2
+#endif
 
 #define WINDOW_HEIGHT 480
 #define WINDOW_WIDTH 640
 
 #define TEXTURE_SIZE 64
 
-void init()
+void init(bool headless)
 {
   // Initialize SDL
-  if (SDL_Init(SDL_INIT_TIMER | SDL_INIT_VIDEO) < 0)
+  if (SDL_Init(headless ? SDL_INIT_TIMER : SDL_INIT_TIMER | SDL_INIT_VIDEO) < 0)
     throw std::runtime_error("init():" + std::string(SDL_GetError()));
 
+  if (headless)
+    return;
+
   // Initialize PNG loading
   int imgFlags = IMG_INIT_PNG;
   if (!(IMG_Init(imgFlags) & imgFlags))
@@ -30,434 +46,1965 @@ void init()
                              std::string(IMG_GetError()));
 }
 
-namespace
+namespace
+{
+  // Defining a namespace without a name -> Anonymous workspace
+  // Its purpose is to indicate to the compiler that everything
+  // inside of it is UNIQUELY used within this source file.
+
+  SDL_Surface *load_surface_for(const std::string &path,
+                                SDL_Surface *window_surface_ptr)
+  {
+    // Helper function to load a png for a specific surface: the image is
+    // converted to the pixel format of the window and scaled to
+    // TEXTURE_SIZE once, so drawing it is a plain SDL_BlitSurface.
+    auto path_char = path.c_str();
+    auto *image = IMG_Load(path_char);
+    if (image == NULL)
+    {
+      return NULL;
+    }
+
+    // Transparent images keep an alpha channel, in the ARGB layout SDL
+    // blends fastest onto the usual RGB888 windows
+    bool has_alpha = image->format->Amask != 0 || SDL_ISPIXELFORMAT_ALPHA(image->format->format);
+    Uint32 format = has_alpha || window_surface_ptr == NULL
+                        ? (Uint32)SDL_PIXELFORMAT_ARGB8888
+                        : window_surface_ptr->format->format;
+
+    auto *converted = SDL_ConvertSurfaceFormat(image, format, 0);
+    SDL_FreeSurface(image);
+    if (converted == NULL)
+    {
+      return NULL;
+    }
+
+    auto *surface = SDL_CreateRGBSurfaceWithFormat(0, TEXTURE_SIZE, TEXTURE_SIZE, 32, format);
+    if (surface != NULL)
+    {
+      // Copy the pixels as they are, alpha included
+      SDL_SetSurfaceBlendMode(converted, SDL_BLENDMODE_NONE);
+      if (SDL_BlitScaled(converted, NULL, surface, NULL) != 0)
+      {
+        SDL_FreeSurface(surface);
+        surface = NULL;
+      }
+      else
+      {
+        SDL_SetSurfaceBlendMode(surface, has_alpha ? SDL_BLENDMODE_BLEND : SDL_BLENDMODE_NONE);
+      }
+    }
+    SDL_FreeSurface(converted);
+
+    return surface;
+  }
+
+  // Movement rules of the systems of the ground, working on plain
+  // positions and velocities
+
+  int distance(int x_from, int y_from, int x_to, int y_to)
+  {
+    int dist_x = x_to - x_from;
+    int dist_y = y_to - y_from;
+
+    return (int)(std::sqrt(dist_x * dist_x + dist_y * dist_y));
+  }
+
+  void step_towards(int &x_pos, int &y_pos, int x_vel, int y_vel, int x, int y)
+  {
+    int relative_x = x - x_pos;
+    int relative_y = y - y_pos;
+
+    double hyp = std::sqrt(relative_x * relative_x + relative_y * relative_y);
+
+    if (hyp != 0)
+    {
+      x_pos = std::clamp((int)(x_pos + (double)x_vel * (((double)relative_x / hyp))), 0, WINDOW_WIDTH - TEXTURE_SIZE);
+      y_pos = std::clamp((int)(y_pos + (double)y_vel * (((double)relative_y / hyp))), 0, WINDOW_HEIGHT - TEXTURE_SIZE);
+    }
+  }
+
+  // Straight line move, bouncing on the borders of the window
+  void bounce_step(int &x_pos, int &y_pos, int &x_vel, int &y_vel)
+  {
+    x_pos += x_vel;
+    y_pos += y_vel;
+
+    if (x_pos > WINDOW_WIDTH - TEXTURE_SIZE || x_pos < 0)
+    {
+      x_vel = -x_vel;
+    }
+    if (y_pos > WINDOW_HEIGHT - TEXTURE_SIZE || y_pos < 0)
+    {
+      y_vel = -y_vel;
+    }
+  }
+
+#if defined(SIMD_AVX2) || defined(SIMD_SSE2)
+  __m128i select(__m128i mask, __m128i a, __m128i b)
+  {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+  }
+
+  __m128i clamp(__m128i v, __m128i low, __m128i high)
+  {
+    v = select(_mm_cmpgt_epi32(v, high), high, v);
+    return select(_mm_cmplt_epi32(v, low), low, v);
+  }
+
+  __m128i abs(__m128i v)
+  {
+    __m128i sign = _mm_srai_epi32(v, 31);
+    return _mm_sub_epi32(_mm_xor_si128(v, sign), sign);
+  }
+
+  // (int)(x + speed * rel / hyp) for 4 lanes, hyp from both axes: the
+  // same double operations as step_towards, so the same results
+  void step_lanes(__m128i x, __m128i y, __m128i x_speed, __m128i y_speed,
+                  __m128i x_rel, __m128i y_rel, __m128i &x_next, __m128i &y_next)
+  {
+#if defined(SIMD_AVX2)
+    __m256d x_reld = _mm256_cvtepi32_pd(x_rel);
+    __m256d y_reld = _mm256_cvtepi32_pd(y_rel);
+    __m256d hyp = _mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(x_reld, x_reld), _mm256_mul_pd(y_reld, y_reld)));
+
+    x_next = _mm256_cvttpd_epi32(_mm256_add_pd(_mm256_cvtepi32_pd(x),
+                                               _mm256_mul_pd(_mm256_cvtepi32_pd(x_speed), _mm256_div_pd(x_reld, hyp))));
+    y_next = _mm256_cvttpd_epi32(_mm256_add_pd(_mm256_cvtepi32_pd(y),
+                                               _mm256_mul_pd(_mm256_cvtepi32_pd(y_speed), _mm256_div_pd(y_reld, hyp))));
+#else
+    // Two lanes of doubles at a time, the low ones then the high ones
+    __m128i x_halves[2], y_halves[2];
+    for (int half = 0; half < 2; half++)
+    {
+      if (half == 1)
+      {
+        x = _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2));
+        y = _mm_shuffle_epi32(y, _MM_SHUFFLE(1, 0, 3, 2));
+        x_speed = _mm_shuffle_epi32(x_speed, _MM_SHUFFLE(1, 0, 3, 2));
+        y_speed = _mm_shuffle_epi32(y_speed, _MM_SHUFFLE(1, 0, 3, 2));
+        x_rel = _mm_shuffle_epi32(x_rel, _MM_SHUFFLE(1, 0, 3, 2));
+        y_rel = _mm_shuffle_epi32(y_rel, _MM_SHUFFLE(1, 0, 3, 2));
+      }
+
+      __m128d x_reld = _mm_cvtepi32_pd(x_rel);
+      __m128d y_reld = _mm_cvtepi32_pd(y_rel);
+      __m128d hyp = _mm_sqrt_pd(_mm_add_pd(_mm_mul_pd(x_reld, x_reld), _mm_mul_pd(y_reld, y_reld)));
+
+      x_halves[half] = _mm_cvttpd_epi32(_mm_add_pd(_mm_cvtepi32_pd(x),
+                                                   _mm_mul_pd(_mm_cvtepi32_pd(x_speed), _mm_div_pd(x_reld, hyp))));
+      y_halves[half] = _mm_cvttpd_epi32(_mm_add_pd(_mm_cvtepi32_pd(y),
+                                                   _mm_mul_pd(_mm_cvtepi32_pd(y_speed), _mm_div_pd(y_reld, hyp))));
+    }
+    x_next = _mm_unpacklo_epi64(x_halves[0], x_halves[1]);
+    y_next = _mm_unpacklo_epi64(y_halves[0], y_halves[1]);
+#endif
+  }
+#endif
+
+  static_assert(sizeof(tag_set) == sizeof(std::int32_t), "tag_set is loaded as 32-bit lanes");
+
+  // Keeps the candidate if nearer than best, or as near with a lower id
+  void keep_nearest(entity id, std::int64_t dist2, entity &best, std::int64_t &best_dist2)
+  {
+    if (best == no_entity || dist2 < best_dist2 || (dist2 == best_dist2 && id < best))
+    {
+      best = id;
+      best_dist2 = dist2;
+    }
+  }
+
+} // namespace
+
+void integrate_movement(int *x_pos, int *y_pos, int *x_vel, int *y_vel,
+                        const movement *moves, const int *target_x, const int *target_y,
+                        std::size_t begin, std::size_t end)
+{
+  std::size_t e = begin;
+
+#if defined(SIMD_AVX2) || defined(SIMD_SSE2)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i x_max = _mm_set1_epi32(WINDOW_WIDTH - TEXTURE_SIZE);
+  const __m128i y_max = _mm_set1_epi32(WINDOW_HEIGHT - TEXTURE_SIZE);
+  const __m128i bounce = _mm_set1_epi32(static_cast<int>(movement::bounce));
+  const __m128i towards = _mm_set1_epi32(static_cast<int>(movement::towards));
+
+  for (; e + 4 <= end; e += 4)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i *)(x_pos + e));
+    __m128i y = _mm_loadu_si128((const __m128i *)(y_pos + e));
+    __m128i x_v = _mm_loadu_si128((const __m128i *)(x_vel + e));
+    __m128i y_v = _mm_loadu_si128((const __m128i *)(y_vel + e));
+
+    std::uint32_t packed;
+    std::memcpy(&packed, moves + e, sizeof(packed));
+    __m128i m = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)packed), zero), zero);
+    __m128i is_bounce = _mm_cmpeq_epi32(m, bounce);
+    __m128i is_towards = _mm_cmpeq_epi32(m, towards);
+
+    // Bounce: move, then turn back on the axes out of the window
+    __m128i x_bounced = _mm_add_epi32(x, x_v);
+    __m128i y_bounced = _mm_add_epi32(y, y_v);
+    __m128i x_out = _mm_or_si128(_mm_cmpgt_epi32(x_bounced, x_max), _mm_cmplt_epi32(x_bounced, zero));
+    __m128i y_out = _mm_or_si128(_mm_cmpgt_epi32(y_bounced, y_max), _mm_cmplt_epi32(y_bounced, zero));
+    __m128i x_v_bounced = select(x_out, _mm_sub_epi32(zero, x_v), x_v);
+    __m128i y_v_bounced = select(y_out, _mm_sub_epi32(zero, y_v), y_v);
+
+    // Towards: a step along the direction, clamped, none when already there
+    __m128i x_rel = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(target_x + e)), x);
+    __m128i y_rel = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(target_y + e)), y);
+    __m128i x_stepped, y_stepped;
+    step_lanes(x, y, abs(x_v), abs(y_v), x_rel, y_rel, x_stepped, y_stepped);
+    __m128i arrived = _mm_and_si128(_mm_cmpeq_epi32(x_rel, zero), _mm_cmpeq_epi32(y_rel, zero));
+    x_stepped = select(arrived, x, clamp(x_stepped, zero, x_max));
+    y_stepped = select(arrived, y, clamp(y_stepped, zero, y_max));
+
+    x = select(is_bounce, x_bounced, select(is_towards, x_stepped, x));
+    y = select(is_bounce, y_bounced, select(is_towards, y_stepped, y));
+    x_v = select(is_bounce, x_v_bounced, x_v);
+    y_v = select(is_bounce, y_v_bounced, y_v);
+
+    _mm_storeu_si128((__m128i *)(x_pos + e), x);
+    _mm_storeu_si128((__m128i *)(y_pos + e), y);
+    _mm_storeu_si128((__m128i *)(x_vel + e), x_v);
+    _mm_storeu_si128((__m128i *)(y_vel + e), y_v);
+  }
+#endif
+
+  for (; e < end; e++)
+  {
+    switch (moves[e])
+    {
+    case movement::bounce:
+      bounce_step(x_pos[e], y_pos[e], x_vel[e], y_vel[e]);
+      break;
+    case movement::towards:
+      step_towards(x_pos[e], y_pos[e], std::abs(x_vel[e]), std::abs(y_vel[e]), target_x[e], target_y[e]);
+      break;
+    case movement::stay:
+      break;
+    }
+  }
+}
+
+void nearest_point(const int *x_pos, const int *y_pos, const tag_set *properties, const entity *ids,
+                   std::size_t begin, std::size_t end, int x, int y, tag_set object_types, entity skip,
+                   bool narrow, entity &best, std::int64_t &best_dist2)
+{
+  std::size_t i = begin;
+
+#if !defined(SIMD_AVX2) && !defined(SIMD_SSE2)
+  (void)narrow; // only the SIMD paths need it
+#endif
+
+#if defined(SIMD_AVX2)
+  constexpr std::size_t lanes = 8;
+  if (narrow && end - begin >= lanes)
+  {
+    const __m256i from_x = _mm256_set1_epi32(x);
+    const __m256i from_y = _mm256_set1_epi32(y);
+    const __m256i types = _mm256_set1_epi32((int)object_types.bits());
+    const __m256i any = _mm256_set1_epi32(object_types.empty() ? -1 : 0);
+    const __m256i skipped = _mm256_set1_epi32((int)skip);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i lane_dist2 = _mm256_set1_epi32(INT32_MAX);
+    __m256i lane_id = _mm256_set1_epi32(INT32_MAX);
+
+    for (; i + lanes <= end; i += lanes)
+    {
+      __m256i dx = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(x_pos + i)), from_x);
+      __m256i dy = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(y_pos + i)), from_y);
+      __m256i dist2 = _mm256_add_epi32(_mm256_mullo_epi32(dx, dx), _mm256_mullo_epi32(dy, dy));
+      __m256i id = _mm256_loadu_si256((const __m256i *)(ids + i));
+      __m256i tags = _mm256_loadu_si256((const __m256i *)(properties + i));
+
+      __m256i match = _mm256_or_si256(any, _mm256_xor_si256(_mm256_cmpeq_epi32(_mm256_and_si256(tags, types), zero),
+                                                            _mm256_set1_epi32(-1)));
+      match = _mm256_andnot_si256(_mm256_cmpeq_epi32(id, skipped), match);
+      __m256i nearer = _mm256_or_si256(_mm256_cmpgt_epi32(lane_dist2, dist2),
+                                       _mm256_and_si256(_mm256_cmpeq_epi32(lane_dist2, dist2),
+                                                        _mm256_cmpgt_epi32(lane_id, id)));
+      nearer = _mm256_and_si256(match, nearer);
+      lane_dist2 = _mm256_blendv_epi8(lane_dist2, dist2, nearer);
+      lane_id = _mm256_blendv_epi8(lane_id, id, nearer);
+    }
+
+    alignas(32) std::int32_t dists[lanes], found[lanes];
+    _mm256_store_si256((__m256i *)dists, lane_dist2);
+    _mm256_store_si256((__m256i *)found, lane_id);
+    for (std::size_t lane = 0; lane < lanes; lane++)
+    {
+      if (found[lane] != INT32_MAX)
+      {
+        keep_nearest((entity)found[lane], dists[lane], best, best_dist2);
+      }
+    }
+  }
+#elif defined(SIMD_SSE2)
+  constexpr std::size_t lanes = 4;
+  if (narrow && end - begin >= lanes)
+  {
+    const __m128i from_x = _mm_set1_epi32(x);
+    const __m128i from_y = _mm_set1_epi32(y);
+    const __m128i types = _mm_set1_epi32((int)object_types.bits());
+    const __m128i any = _mm_set1_epi32(object_types.empty() ? -1 : 0);
+    const __m128i skipped = _mm_set1_epi32((int)skip);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lane_dist2 = _mm_set1_epi32(INT32_MAX);
+    __m128i lane_id = _mm_set1_epi32(INT32_MAX);
+
+    for (; i + lanes <= end; i += lanes)
+    {
+      __m128i dx = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(x_pos + i)), from_x);
+      __m128i dy = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(y_pos + i)), from_y);
+      // No 32-bit multiply in SSE2: dx and dy fit 16 bits, interleaved
+      // so that one multiply-add gives dx * dx + dy * dy per lane
+      __m128i packed = _mm_packs_epi32(dx, dy);
+      __m128i pairs = _mm_unpacklo_epi16(packed, _mm_srli_si128(packed, 8));
+      __m128i dist2 = _mm_madd_epi16(pairs, pairs);
+      __m128i id = _mm_loadu_si128((const __m128i *)(ids + i));
+      __m128i tags = _mm_loadu_si128((const __m128i *)(properties + i));
+
+      __m128i match = _mm_or_si128(any, _mm_xor_si128(_mm_cmpeq_epi32(_mm_and_si128(tags, types), zero),
+                                                      _mm_set1_epi32(-1)));
+      match = _mm_andnot_si128(_mm_cmpeq_epi32(id, skipped), match);
+      __m128i nearer = _mm_or_si128(_mm_cmplt_epi32(dist2, lane_dist2),
+                                    _mm_and_si128(_mm_cmpeq_epi32(dist2, lane_dist2), _mm_cmplt_epi32(id, lane_id)));
+      nearer = _mm_and_si128(match, nearer);
+      lane_dist2 = select(nearer, dist2, lane_dist2);
+      lane_id = select(nearer, id, lane_id);
+    }
+
+    alignas(16) std::int32_t dists[lanes], found[lanes];
+    _mm_store_si128((__m128i *)dists, lane_dist2);
+    _mm_store_si128((__m128i *)found, lane_id);
+    for (std::size_t lane = 0; lane < lanes; lane++)
+    {
+      if (found[lane] != INT32_MAX)
+      {
+        keep_nearest((entity)found[lane], dists[lane], best, best_dist2);
+      }
+    }
+  }
+#endif
+
+  for (; i < end; i++)
+  {
+    if (ids[i] == skip || !(object_types.empty() || properties[i].intersects(object_types)))
+    {
+      continue;
+    }
+
+    std::int64_t dist_x = x_pos[i] - (std::int64_t)x;
+    std::int64_t dist_y = y_pos[i] - (std::int64_t)y;
+    keep_nearest(ids[i], dist_x * dist_x + dist_y * dist_y, best, best_dist2);
+  }
+}
+
+namespace
+{
+  // Move driven by the keys held down (zqsd)
+  void keyboard_step(int &x_pos, int &y_pos, int x_vel, int y_vel, const input_state &input)
+  {
+    int next_x = x_pos, next_y = y_pos;
+
+    if (input.is_down(SDLK_q))
+    {
+      next_x -= x_vel;
+    }
+    if (input.is_down(SDLK_s))
+    {
+      next_y += y_vel;
+    }
+    if (input.is_down(SDLK_d))
+    {
+      next_x += x_vel;
+    }
+    if (input.is_down(SDLK_z))
+    {
+      next_y -= y_vel;
+    }
+
+    x_pos = std::clamp(next_x, 0, WINDOW_WIDTH - TEXTURE_SIZE);
+    y_pos = std::clamp(next_y, 0, WINDOW_HEIGHT - TEXTURE_SIZE);
+  }
+
+  // Circle around a target at a given distance, a radian every 200 ms of
+  // simulated time at velocity 1
+  // std::cos and std::sin may round differently from one libm to another:
+  // a dog's orbit is the one thing a seed may not replay bit-identically
+  // across platforms
+  void orbit(int &x_pos, int &y_pos, int x_vel, int y_vel, int target_dist, int target_x, int target_y,
+             const sim_clock &clock)
+  {
+    double angle = clock.seconds() * 1000 / 200.0;
+    x_pos = target_dist * std::cos(x_vel * angle) + target_x;
+    y_pos = target_dist * std::sin(y_vel * angle) + target_y;
+  }
+
+  int distance(const entity_store &entities, entity from, entity to)
+  {
+    return distance(entities.x_pos[from], entities.y_pos[from], entities.x_pos[to], entities.y_pos[to]);
+  }
+
+  // Moves the kept elements of a component array to their new index
+  template <typename T>
+  void compact(std::vector<T> &column, const std::vector<entity> &remap, std::size_t kept)
+  {
+    for (std::size_t i = 0; i < column.size(); i++)
+    {
+      if (remap[i] != no_entity)
+      {
+        column[remap[i]] = column[i];
+      }
+    }
+    column.resize(kept);
+  }
+} // namespace
+
+/* Random numbers */
+namespace
+{
+  // SplitMix64 output function
+  std::uint64_t mix(std::uint64_t z)
+  {
+    z += 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+  }
+} // namespace
+
+std::uint64_t counter_rng::bits(std::uint64_t id, std::uint64_t tick, random_draw draw) const
+{
+  std::uint64_t z = mix(this->seed_);
+  z = mix(z ^ id);
+  z = mix(z ^ tick);
+  return mix(z ^ static_cast<std::uint64_t>(draw));
+}
+
+std::uint32_t counter_rng::below(std::uint32_t bound, std::uint64_t id, std::uint64_t tick, random_draw draw) const
+{
+  // Multiply-shift rather than modulo: no division, and the high bits
+  return static_cast<std::uint32_t>(((this->bits(id, tick, draw) >> 32) * bound) >> 32);
+}
+
+std::uint64_t counter_rng::geometric(std::uint64_t mean, std::uint64_t id, std::uint64_t tick, random_draw draw) const
+{
+  // The largest n with q^n >= u, for q = 1 - 1 / mean and u uniform in
+  // (0, 1], in 32-bit fixed point: n is built bit by bit from q^(2^k),
+  // squared from q. Unlike std::log, the same on every platform.
+  constexpr std::uint64_t one = std::uint64_t{1} << 32;
+  std::uint64_t u = (this->bits(id, tick, draw) >> 32) + 1;
+
+  std::array<std::uint64_t, 48> powers;
+  powers[0] = one - (one + mean - 1) / mean;
+  for (std::size_t k = 1; k < powers.size(); k++)
+  {
+    powers[k] = (powers[k - 1] * powers[k - 1]) >> 32;
+  }
+
+  std::uint64_t n = 0;
+  std::uint64_t survival = one;
+  for (std::size_t k = powers.size(); k-- > 0;)
+  {
+    std::uint64_t next = (survival * powers[k]) >> 32;
+    if (next >= u)
+    {
+      survival = next;
+      n += std::uint64_t{1} << k;
+    }
+  }
+  return n;
+}
+
+std::shared_ptr<SDL_Surface> sprite_cache::load(const std::string &path, SDL_Surface *window_surface_ptr)
+{
+  // The same image is prepared differently for windows of other formats
+  auto &cached = this->surfaces_[{path, window_surface_ptr == NULL ? (Uint32)SDL_PIXELFORMAT_UNKNOWN
+                                                                   : window_surface_ptr->format->format}];
+  if (auto surface = cached.lock())
+  {
+    return surface;
+  }
+
+  auto *raw_surface = load_surface_for(path, window_surface_ptr);
+  if (raw_surface == NULL)
+  {
+    throw std::runtime_error("sprite_cache: couldn't load " + path + ": " + std::string(IMG_GetError()));
+  }
+
+  std::shared_ptr<SDL_Surface> surface(raw_surface, SDL_FreeSurface);
+  cached = surface;
+
+  return surface;
+}
+
+sprite_cache &sprite_cache::global()
+{
+  static sprite_cache cache;
+  return cache;
+}
+
+void input_state::pump()
+{
+  SDL_Event event;
+
+  this->events_.clear();
+  while (SDL_PollEvent(&event))
+  {
+    switch (event.type)
+    {
+    case SDL_KEYDOWN:
+      this->keys_down_[event.key.keysym.scancode].store(true, std::memory_order_relaxed);
+      break;
+    case SDL_KEYUP:
+      this->keys_down_[event.key.keysym.scancode].store(false, std::memory_order_relaxed);
+      break;
+    case SDL_QUIT:
+      this->quit_ = true;
+      break;
+    }
+    this->events_.push_back(event);
+  }
+}
+
+bool input_state::is_down(SDL_Keycode key) const
+{
+  return this->keys_down_[SDL_GetScancodeFromKey(key)].load(std::memory_order_relaxed);
+}
+
+input_state &input_state::global()
+{
+  static input_state input;
+  return input;
+}
+
+renderer::renderer(SDL_Window *window_ptr)
+    : window_ptr_{window_ptr},
+      window_surface_ptr_{window_ptr == NULL ? NULL : SDL_GetWindowSurface(window_ptr)},
+      full_{true}
+{
+  if (this->window_surface_ptr_ == NULL)
+  {
+    return;
+  }
+
+  auto *format = this->window_surface_ptr_->format;
+  auto *background = SDL_CreateRGBSurfaceWithFormat(0, this->window_surface_ptr_->w, this->window_surface_ptr_->h,
+                                                    format->BitsPerPixel, format->format);
+  if (background == NULL)
+  {
+    throw std::runtime_error("renderer: couldn't create the background: " + std::string(SDL_GetError()));
+  }
+
+  this->background_ = std::shared_ptr<SDL_Surface>(background, SDL_FreeSurface);
+  SDL_FillRect(background, NULL, 0x00FF00);
+}
+
+void renderer::draw_region(view<const sprite_instance> sprites, const SDL_Rect &region)
+{
+  SDL_Rect target = region;
+  if (SDL_BlitSurface(this->background_.get(), &region, this->window_surface_ptr_, &target) != 0)
+  {
+    throw std::runtime_error("Couldn't restore the background");
+  }
+
+  // Only the part of each sprite inside the region, so that the sprites
+  // around it stay drawn in order
+  for (auto &sprite : sprites)
+  {
+    SDL_Rect part;
+    if (!SDL_IntersectRect(&sprite.rect, &region, &part))
+    {
+      continue;
+    }
+
+    SDL_Rect source = SDL_Rect{part.x - sprite.rect.x, part.y - sprite.rect.y, part.w, part.h};
+    if (SDL_BlitSurface(sprite.image, &source, this->window_surface_ptr_, &part) != 0)
+    {
+      throw std::runtime_error("Couldn't draw texture on rectangle");
+    }
+  }
+}
+
+void renderer::present(view<const sprite_instance> sprites)
+{
+  this->dirty_.clear();
+  if (this->window_surface_ptr_ == NULL)
+  {
+    return;
+  }
+
+  auto before = [](const sprite_instance &a, const sprite_instance &b) {
+    if (a.image != b.image)
+    {
+      return std::less<SDL_Surface *>()(a.image, b.image);
+    }
+    return std::tie(a.rect.x, a.rect.y, a.rect.w, a.rect.h) < std::tie(b.rect.x, b.rect.y, b.rect.w, b.rect.h);
+  };
+
+  this->next_.assign(sprites.begin(), sprites.end());
+  std::sort(this->next_.begin(), this->next_.end(), before);
+
+  if (!this->full_)
+  {
+    // The sprites of only one of the frames, on the window
+    const SDL_Rect window = SDL_Rect{0, 0, this->window_surface_ptr_->w, this->window_surface_ptr_->h};
+    auto mark = [&](const sprite_instance &sprite) {
+      SDL_Rect clipped;
+      if (SDL_IntersectRect(&sprite.rect, &window, &clipped))
+      {
+        this->dirty_.push_back(clipped);
+      }
+    };
+
+    std::size_t i = 0, j = 0;
+    while (i < this->shown_.size() || j < this->next_.size())
+    {
+      if (j == this->next_.size() || (i < this->shown_.size() && before(this->shown_[i], this->next_[j])))
+      {
+        mark(this->shown_[i++]);
+      }
+      else if (i == this->shown_.size() || before(this->next_[j], this->shown_[i]))
+      {
+        mark(this->next_[j++]);
+      }
+      else
+      {
+        i++;
+        j++;
+      }
+    }
+
+    this->full_ = this->dirty_.size() > max_dirty_rects;
+  }
+
+  if (this->full_)
+  {
+    SDL_Rect window = SDL_Rect{0, 0, this->window_surface_ptr_->w, this->window_surface_ptr_->h};
+    this->dirty_.assign(1, window);
+    this->draw_region(sprites, window);
+    SDL_UpdateWindowSurface(this->window_ptr_);
+    this->full_ = false;
+  }
+  else if (!this->dirty_.empty())
+  {
+    for (auto &region : this->dirty_)
+    {
+      this->draw_region(sprites, region);
+    }
+    SDL_UpdateWindowSurfaceRects(this->window_ptr_, this->dirty_.data(), (int)this->dirty_.size());
+  }
+
+  std::swap(this->shown_, this->next_);
+}
+
+void world_snapshot::frame(double alpha, std::vector<sprite_instance> &instances) const
+{
+  instances.clear();
+  for (auto &sprite : this->sprites)
+  {
+    int x_pos = (int)std::lround(sprite.previous_x_pos + alpha * (sprite.x_pos - sprite.previous_x_pos));
+    int y_pos = (int)std::lround(sprite.previous_y_pos + alpha * (sprite.y_pos - sprite.previous_y_pos));
+
+    instances.push_back(sprite_instance{sprite.image, SDL_Rect{x_pos, y_pos, TEXTURE_SIZE, TEXTURE_SIZE}});
+  }
+}
+
+/* Entity store */
+entity entity_store::push_back(species k, int x, int y, int x_v, int y_v, tag_set props, sprite_id s)
+{
+  this->kind.push_back(k);
+  this->x_pos.push_back(x);
+  this->y_pos.push_back(y);
+  this->previous_x_pos.push_back(x);
+  this->previous_y_pos.push_back(y);
+  this->x_vel.push_back(x_v);
+  this->y_vel.push_back(y_v);
+  this->properties.push_back(props);
+  this->starves_at.push_back(0);
+  this->target.push_back(no_handle);
+  this->target_dist.push_back(0);
+  this->sprite.push_back(s);
+
+  entity e = (entity)(this->size() - 1);
+  std::uint32_t free_slot;
+  if (!this->free_slots_.empty())
+  {
+    free_slot = this->free_slots_.back();
+    this->free_slots_.pop_back();
+    this->slots_[free_slot].dense = e;
+  }
+  else
+  {
+    free_slot = (std::uint32_t)this->slots_.size();
+    this->slots_.push_back(slot{e, 0});
+  }
+  this->handle.push_back(entity_handle{free_slot, this->slots_[free_slot].generation});
+
+  return e;
+}
+
+void entity_store::erase(view<const entity> doomed)
+{
+  if (doomed.size() == 0)
+  {
+    return;
+  }
+
+  this->remap_.assign(this->size(), 0);
+  for (entity e : doomed)
+  {
+    this->remap_[e] = no_entity;
+  }
+
+  std::size_t kept = 0;
+  for (auto &r : this->remap_)
+  {
+    if (r != no_entity)
+    {
+      r = (entity)kept++;
+    }
+  }
+
+  compact(this->kind, this->remap_, kept);
+  compact(this->x_pos, this->remap_, kept);
+  compact(this->y_pos, this->remap_, kept);
+  compact(this->previous_x_pos, this->remap_, kept);
+  compact(this->previous_y_pos, this->remap_, kept);
+  compact(this->x_vel, this->remap_, kept);
+  compact(this->y_vel, this->remap_, kept);
+  compact(this->properties, this->remap_, kept);
+  compact(this->starves_at, this->remap_, kept);
+  compact(this->target, this->remap_, kept);
+  compact(this->target_dist, this->remap_, kept);
+  compact(this->sprite, this->remap_, kept);
+
+  for (entity e = 0; e < this->remap_.size(); e++)
+  {
+    slot &s = this->slots_[this->handle[e].slot];
+    if (this->remap_[e] == no_entity)
+    {
+      s.generation++;
+      this->free_slots_.push_back(this->handle[e].slot);
+    }
+    else
+    {
+      s.dense = this->remap_[e];
+    }
+  }
+  compact(this->handle, this->remap_, kept);
+}
+
+/* Timer wheel */
+void timer_wheel::link(std::uint32_t n)
+{
+  // Past the last level, timers wait in its furthest slot and go round
+  // again when it comes
+  constexpr std::uint64_t horizon = std::uint64_t{1} << (slot_bits * levels);
+  std::uint64_t due = std::min(std::max(this->nodes_[n].t.due, this->now_), this->now_ + horizon - 1);
+  std::uint64_t delta = due - this->now_;
+
+  int level = 0;
+  while (level < levels - 1 && delta >= (std::uint64_t{1} << (slot_bits * (level + 1))))
+  {
+    level++;
+  }
+
+  std::uint32_t &head = this->wheels_[level * slots + ((due >> (slot_bits * level)) & (slots - 1))];
+  this->nodes_[n].next = head;
+  head = n;
+}
+
+void timer_wheel::schedule(entity_handle target, timer_event event, std::uint64_t due)
+{
+  std::lock_guard<std::mutex> lock(this->mutex_);
+
+  std::uint32_t n = this->free_;
+  if (n != no_node)
+  {
+    this->free_ = this->nodes_[n].next;
+  }
+  else
+  {
+    n = (std::uint32_t)this->nodes_.size();
+    this->nodes_.push_back(node{});
+  }
+
+  this->nodes_[n].t = timer{due, target, event};
+  this->link(n);
+  this->size_++;
+}
+
+void timer_wheel::advance(std::uint64_t tick, std::vector<timer> &expired)
+{
+  std::size_t first = expired.size();
+
+  while (this->now_ < tick)
+  {
+    this->now_++;
+
+    // When a slot of a level comes round, its timers are due within the
+    // slot width of the level below, and move down there
+    int top = 0;
+    while (top < levels - 1 && (this->now_ & ((std::uint64_t{1} << (slot_bits * (top + 1))) - 1)) == 0)
+    {
+      top++;
+    }
+    for (int level = top; level > 0; level--)
+    {
+      std::uint32_t &head = this->wheels_[level * slots + ((this->now_ >> (slot_bits * level)) & (slots - 1))];
+      std::uint32_t n = head;
+      head = no_node;
+      while (n != no_node)
+      {
+        std::uint32_t next = this->nodes_[n].next;
+        this->link(n);
+        n = next;
+      }
+    }
+
+    std::uint32_t &head = this->wheels_[this->now_ & (slots - 1)];
+    std::uint32_t n = head;
+    head = no_node;
+    while (n != no_node)
+    {
+      std::uint32_t next = this->nodes_[n].next;
+      expired.push_back(this->nodes_[n].t);
+      this->nodes_[n].next = this->free_;
+      this->free_ = n;
+      this->size_--;
+      n = next;
+    }
+  }
+
+  std::sort(expired.begin() + first, expired.end(), [](const timer &a, const timer &b) {
+    return std::tie(a.due, a.target, a.event) < std::tie(b.due, b.target, b.event);
+  });
+}
+
+/* Spatial grid */
+spatial_grid::spatial_grid(int width, int height, int cell_size)
+    : cell_size_{cell_size},
+      columns_{std::max(1, (width + cell_size - 1) / cell_size)},
+      rows_{std::max(1, (height + cell_size - 1) / cell_size)},
+      cell_start_(columns_ * rows_ + 1),
+      narrow_{true}
+{
+}
+
+int spatial_grid::cell_index(int x_pos, int y_pos) const
+{
+  // Entities outside of the window are kept in the border cells
+  int column = std::clamp(x_pos / cell_size_, 0, columns_ - 1);
+  int row = std::clamp(y_pos / cell_size_, 0, rows_ - 1);
+
+  return row * columns_ + column;
+}
+
+void spatial_grid::rebuild(const entity_store &entities)
+{
+  std::size_t n = entities.size();
+  this->cell_of_.resize(n);
+  this->ids_.resize(n);
+  this->x_pos_.resize(n);
+  this->y_pos_.resize(n);
+  this->properties_.resize(n);
+
+  // Counting sort by cell, stable so that each cell lists its entities in
+  // increasing order
+  std::fill(this->cell_start_.begin(), this->cell_start_.end(), 0);
+  this->narrow_ = true;
+  for (entity e = 0; e < n; e++)
+  {
+    int x = entities.x_pos[e], y = entities.y_pos[e];
+    this->cell_of_[e] = cell_index(x, y);
+    this->cell_start_[this->cell_of_[e] + 1]++;
+
+    if (x < -16384 || x > 16383 || y < -16384 || y > 16383)
+    {
+      this->narrow_ = false;
+    }
+  }
+  std::partial_sum(this->cell_start_.begin(), this->cell_start_.end(), this->cell_start_.begin());
+
+  // Filled from the end of each cell, backwards
+  for (entity e = n; e-- > 0;)
+  {
+    std::uint32_t slot = --this->cell_start_[this->cell_of_[e] + 1];
+    this->ids_[slot] = e;
+    this->x_pos_[slot] = entities.x_pos[e];
+    this->y_pos_[slot] = entities.y_pos[e];
+    this->properties_[slot] = entities.properties[e];
+  }
+  // Each cell_start_[c + 1] now points at the start of the cell c: shift back
+  std::copy(this->cell_start_.begin() + 1, this->cell_start_.end(), this->cell_start_.begin());
+  this->cell_start_.back() = n;
+}
+
+entity spatial_grid::find_closest_entity(const entity_store &entities, entity from, tag_set object_types) const
+{
+  return this->find_closest_entities(entities, from, view<const tag_set>(&object_types, 1))[0];
+}
+
+closest_entities spatial_grid::find_closest_entities(const entity_store &entities, entity from, view<const tag_set> lookups) const
+{
+  if (lookups.size() > max_lookups)
+  {
+    throw std::runtime_error("find_closest_entities(): too many object types");
+  }
+
+  int x = entities.x_pos[from], y = entities.y_pos[from];
+  int origin = cell_index(x, y);
+  int origin_column = origin % columns_;
+  int origin_row = origin / columns_;
+
+  closest_entities closest;
+  closest.fill(no_entity);
+  std::array<std::int64_t, max_lookups> closest_dist2{};
+
+  // The entities of the cells [first_column, last_column] of a row
+  auto scan = [&](int row, int first_column, int last_column) {
+    std::size_t begin = this->cell_start_[row * columns_ + first_column];
+    std::size_t end = this->cell_start_[row * columns_ + last_column + 1];
+
+    for (std::size_t t = 0; t < lookups.size(); t++)
+    {
+      nearest_point(this->x_pos_.data(), this->y_pos_.data(), this->properties_.data(), this->ids_.data(),
+                    begin, end, x, y, lookups[t], from, this->narrow_, closest[t], closest_dist2[t]);
+    }
+  };
+
+  for (int ring = 0; ring <= std::max(columns_, rows_); ring++)
+  {
+    // Everything from this ring on is more than (ring - 1) cells away on
+    // one axis, so it can neither beat nor tie what was already found
+    std::int64_t bound = std::int64_t{std::max(0, ring - 1)} * cell_size_;
+    bool done = ring > 0;
+    for (std::size_t t = 0; t < lookups.size(); t++)
+    {
+      if (closest[t] == no_entity || closest_dist2[t] >= bound * bound)
+      {
+        done = false;
+      }
+    }
+    if (done)
+    {
+      break;
+    }
+
+    int first_column = std::max(0, origin_column - ring);
+    int last_column = std::min(columns_ - 1, origin_column + ring);
+
+    for (int row = std::max(0, origin_row - ring); row <= std::min(rows_ - 1, origin_row + ring); row++)
+    {
+      // Only the border of the ring, the inside was scanned before: whole
+      // rows at the top and bottom, the two side cells in between
+      if (row == origin_row - ring || row == origin_row + ring)
+      {
+        scan(row, first_column, last_column);
+        continue;
+      }
+
+      if (origin_column - ring >= 0)
+      {
+        scan(row, origin_column - ring, origin_column - ring);
+      }
+      if (origin_column + ring < columns_)
+      {
+        scan(row, origin_column + ring, origin_column + ring);
+      }
+    }
+  }
+
+  return closest;
+}
+
+void spatial_grid::find_contacts(int radius, std::vector<contact> &contacts) const
+{
+  if (radius > cell_size_)
+  {
+    throw std::runtime_error("find_contacts(): radius larger than the cells");
+  }
+
+  // Each pair of neighbouring cells once: the cell itself, then the one on
+  // its right and the three below it
+  static const int neighbours[][2] = {{1, 0}, {-1, 1}, {0, 1}, {1, 1}};
+
+  // Positions in the sorted arrays
+  auto test = [&](std::size_t a, std::size_t b) {
+    int dist_x = this->x_pos_[b] - this->x_pos_[a];
+    int dist_y = this->y_pos_[b] - this->y_pos_[a];
+    if (dist_x * dist_x + dist_y * dist_y < radius * radius)
+    {
+      entity first = this->ids_[a], second = this->ids_[b];
+      contacts.push_back(first < second ? contact{first, second} : contact{second, first});
+    }
+  };
+
+  contacts.clear();
+  for (int row = 0; row < rows_; row++)
+  {
+    for (int column = 0; column < columns_; column++)
+    {
+      int cell = row * columns_ + column;
+      std::size_t begin = this->cell_start_[cell], end = this->cell_start_[cell + 1];
+
+      for (std::size_t i = begin; i < end; i++)
+      {
+        for (std::size_t j = i + 1; j < end; j++)
+        {
+          test(i, j);
+        }
+      }
+
+      for (auto &offset : neighbours)
+      {
+        int other_column = column + offset[0];
+        int other_row = row + offset[1];
+        if (other_column < 0 || other_column >= columns_ || other_row >= rows_)
+        {
+          continue;
+        }
+
+        int other = other_row * columns_ + other_column;
+        for (std::size_t i = begin; i < end; i++)
+        {
+          for (std::size_t j = this->cell_start_[other]; j < this->cell_start_[other + 1]; j++)
+          {
+            test(i, j);
+          }
+        }
+      }
+    }
+  }
+}
+
+/* Job system */
+namespace
+{
+  // Deque owned by the running thread, for the job system it works for
+  thread_local const job_system *current_jobs = nullptr;
+  thread_local unsigned current_queue = 0;
+} // namespace
+
+job_system::job_system(unsigned threads)
+    : queued_{0},
+      sleeping_{0},
+      stopping_{false}
+{
+  if (threads == 0)
+  {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  this->queue_count_ = threads;
+  this->queues_.reset(new queue[threads]);
+
+  // The first deque is the one of the threads outside of the system
+  for (unsigned i = 1; i < threads; i++)
+  {
+    this->workers_.emplace_back(&job_system::work, this, i);
+  }
+}
+
+job_system::~job_system()
+{
+  {
+    std::lock_guard<std::mutex> lock(this->sleep_mutex_);
+    this->stopping_ = true;
+  }
+  this->wake_.notify_all();
+
+  for (auto &worker : this->workers_)
+  {
+    worker.join();
+  }
+}
+
+void job_system::job_ring::push_back(const job &j)
+{
+  if (this->size_ == this->slots_.size())
+  {
+    // Unroll the ring into a buffer twice as large
+    std::vector<job> grown(std::max<std::size_t>(16, 2 * this->slots_.size()));
+    for (std::size_t i = 0; i < this->size_; i++)
+    {
+      grown[i] = this->slots_[(this->head_ + i) & (this->slots_.size() - 1)];
+    }
+    this->slots_.swap(grown);
+    this->head_ = 0;
+  }
+
+  this->slots_[(this->head_ + this->size_) & (this->slots_.size() - 1)] = j;
+  this->size_++;
+}
+
+job_system::job job_system::job_ring::pop_back()
+{
+  this->size_--;
+  return this->slots_[(this->head_ + this->size_) & (this->slots_.size() - 1)];
+}
+
+job_system::job job_system::job_ring::pop_front()
 {
-  // Defining a namespace without a name -> Anonymous workspace
-  // Its purpose is to indicate to the compiler that everything
-  // inside of it is UNIQUELY used within this source file.
+  job j = this->slots_[this->head_];
+  this->head_ = (this->head_ + 1) & (this->slots_.size() - 1);
+  this->size_--;
+  return j;
+}
 
-  SDL_Surface *load_surface_for(const std::string &path,
-                                SDL_Surface *window_surface_ptr)
+unsigned job_system::own_queue() const
+{
+  return current_jobs == this ? current_queue : 0;
+}
+
+void job_system::push(const job &j)
+{
+  queue &q = this->queues_[this->own_queue()];
   {
-    // Helper function to load a png for a specific surface
-    // See SDL_ConvertSurface
-    auto path_char = path.c_str();
-    auto *surface = IMG_Load(path_char);
+    std::lock_guard<std::mutex> lock(q.mutex);
+    q.jobs.push_back(j);
+  }
+  this->queued_++;
 
-    return surface;
+  // Only take the sleep lock when a worker may be waiting on it
+  if (this->sleeping_ > 0)
+  {
+    std::lock_guard<std::mutex> lock(this->sleep_mutex_);
+    this->wake_.notify_one();
   }
-} // namespace
-interacting_object::interacting_object(const std::set<std::string> properties)
-    : properties_{properties}
-{
 }
 
-rendered_object::rendered_object(
-    const std::string &file_path,
-    SDL_Surface *window_surface_ptr,
-    int x_pos, int y_pos,
-    std::set<std::string> properties)
-    : interacting_object{properties},
-      window_surface_ptr_{window_surface_ptr},
-      image_ptr_{load_surface_for(file_path, window_surface_ptr)},
-      x_pos_{x_pos},
-      y_pos_{y_pos}
+bool job_system::pop(job &j)
 {
+  if (this->queued_ == 0)
+  {
+    return false;
+  }
+
+  unsigned own = this->own_queue();
+  for (unsigned i = 0; i < this->queue_count_; i++)
+  {
+    queue &q = this->queues_[(own + i) % this->queue_count_];
+    std::lock_guard<std::mutex> lock(q.mutex);
+
+    if (!q.jobs.empty())
+    {
+      // Newest own job (hot in cache), oldest stolen job (the largest)
+      j = i == 0 ? q.jobs.pop_back() : q.jobs.pop_front();
+      this->queued_--;
+      return true;
+    }
+  }
+
+  return false;
 }
 
-rendered_object::~rendered_object()
+void job_system::run(job j)
 {
-  SDL_FreeSurface(image_ptr_);
+  // Keep the first half, leaving the second one to be stolen
+  while (j.end - j.begin > j.grain)
+  {
+    std::size_t middle = j.begin + (j.end - j.begin) / 2;
+    j.counter->pending++;
+    this->push(job{j.body, middle, j.end, j.grain, j.counter});
+    j.end = middle;
+  }
+
+  (*j.body)(j.begin, j.end);
+  j.counter->pending--;
 }
 
-void rendered_object::draw(SDL_Surface *window_surface_ptr)
+void job_system::work(unsigned index)
 {
-  SDL_Rect rect = SDL_Rect{this->x_pos_, this->y_pos_, TEXTURE_SIZE, TEXTURE_SIZE};
-  auto blitRes = SDL_BlitScaled(this->image_ptr_, NULL, window_surface_ptr, &rect);
+  current_jobs = this;
+  current_queue = index;
 
-  if (blitRes != 0)
+  while (true)
   {
-    std::runtime_error("Couldn't draw texture on rectangle");
+    job j;
+    if (this->pop(j))
+    {
+      this->run(j);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(this->sleep_mutex_);
+    this->sleeping_++;
+    this->wake_.wait(lock, [this] { return this->stopping_ || this->queued_ > 0; });
+    this->sleeping_--;
+
+    if (this->stopping_)
+    {
+      return;
+    }
   }
 }
 
-moving_object::moving_object(
-    const std::string &file_path,
-    SDL_Surface *window_surface_ptr,
-    int x_pos, int y_pos,
-    int x_vel, int y_vel,
-    std::set<std::string> properties)
-    : rendered_object(file_path, window_surface_ptr, x_pos, y_pos, properties),
-      x_vel_{x_vel},
-      y_vel_(y_vel)
+void job_system::submit(const range_body &body, std::size_t begin, std::size_t end, job_counter &counter, std::size_t grain)
 {
+  counter.pending++;
+  this->push(job{&body, begin, end, std::max<std::size_t>(1, grain), &counter});
 }
 
-void moving_object::move_towards(const int x, const int y)
+void job_system::wait(job_counter &counter)
 {
-  int relative_x = x - x_pos_;
-  int relative_y = y - y_pos_;
+  while (counter.pending != 0)
+  {
+    job j;
+    if (this->pop(j))
+    {
+      this->run(j);
+    }
+    else
+    {
+      std::this_thread::yield();
+    }
+  }
+}
 
-  double hyp = std::sqrt(relative_x * relative_x + relative_y * relative_y);
+void job_system::parallel_for(std::size_t count, const range_body &body, std::size_t grain)
+{
+  if (grain == 0)
+  {
+    grain = std::max<std::size_t>(64, count / (this->size() * 8));
+  }
 
-  if (hyp != 0)
+  if (this->workers_.empty() || count <= grain)
   {
-    this->x_pos_ = std::clamp((int)(this->x_pos_ + (double)this->x_vel_ * (((double)relative_x / hyp))), 0, WINDOW_WIDTH - TEXTURE_SIZE);
-    this->y_pos_ = std::clamp((int)(this->y_pos_ + (double)this->y_vel_ * (((double)relative_y / hyp))), 0, WINDOW_HEIGHT - TEXTURE_SIZE);
+    if (count > 0)
+    {
+      body(0, count);
+    }
+    return;
   }
+
+  job_counter counter;
+  counter.pending = 1;
+  this->run(job{&body, 0, count, grain, &counter});
+  this->wait(counter);
 }
 
-int moving_object::distance(moving_object &object) const
+/* Task graph */
+std::size_t task_graph::add(std::function<void()> work)
 {
-  int dist_x = object.get_x_pos() - this->x_pos_;
-  int dist_y = object.get_y_pos() - this->y_pos_;
+  std::size_t index = this->nodes_.size();
+  this->nodes_.push_back(std::make_unique<node>());
+
+  node *n = this->nodes_.back().get();
+  n->work = std::move(work);
+  n->dependencies = 0;
+  n->body = [this, n](std::size_t, std::size_t) {
+    n->work();
+
+    for (std::size_t successor : n->successors)
+    {
+      node &next = *this->nodes_[successor];
+      if (--next.remaining == 0)
+      {
+        this->jobs_->submit(next.body, 0, 1, this->counter_);
+      }
+    }
+  };
 
-  return (int)(std::sqrt(dist_x * dist_x + dist_y * dist_y));
+  return index;
 }
 
-playable_character::playable_character(const std::string &file_path,
-                                       SDL_Surface *window_surface_ptr,
-                                       int x_pos, int y_pos,
-                                       int x_vel, int y_vel,
-                                       std::set<std::string> properties)
-    : moving_object(file_path, window_surface_ptr, x_pos, y_pos, x_vel, y_vel, properties)
+void task_graph::precede(std::size_t before, std::size_t after)
 {
+  this->nodes_[before]->successors.push_back(after);
+  this->nodes_[after]->dependencies++;
 }
 
-void playable_character::move()
+void task_graph::run(job_system &jobs)
 {
-  SDL_Event event;
-  int next_x = this->x_pos_, next_y = this->y_pos_;
+  this->jobs_ = &jobs;
+
+  for (auto &n : this->nodes_)
+  {
+    n->remaining = n->dependencies;
+  }
 
-  if (SDL_PollEvent(&event))
+  for (auto &n : this->nodes_)
   {
-    if (event.type == SDL_KEYDOWN)
+    if (n->dependencies == 0)
     {
-      switch (event.key.keysym.sym)
-      {
-      case SDLK_q:
-        next_x -= x_vel_;
-        break;
-      case SDLK_s:
-        next_y += y_vel_;
-        break;
-      case SDLK_d:
-        next_x += x_vel_;
-        break;
-      case SDLK_z:
-        next_y -= y_vel_;
-        break;
-      }
+      jobs.submit(n->body, 0, 1, this->counter_);
     }
   }
 
-  this->x_pos_ = std::clamp(next_x, 0, WINDOW_WIDTH - TEXTURE_SIZE);
-  this->y_pos_ = std::clamp(next_y, 0, WINDOW_HEIGHT - TEXTURE_SIZE);
+  jobs.wait(this->counter_);
 }
 
-animal::animal(const std::string &file_path,
-               SDL_Surface *window_surface_ptr,
-               int x_pos, int y_pos,
-               int x_vel, int y_vel,
-               std::set<std::string> properties)
-    : moving_object{file_path, window_surface_ptr, x_pos, y_pos, x_vel, y_vel, properties}
+/* Decisions */
+void decision_buffer::resize(std::size_t size)
 {
+  this->x_pos.resize(size);
+  this->y_pos.resize(size);
+  this->x_vel.resize(size);
+  this->y_vel.resize(size);
+  this->properties.resize(size);
+  for (std::size_t m = 0; m < max_moves; m++)
+  {
+    this->moves[m].resize(size);
+    this->target_x[m].resize(size);
+    this->target_y[m].resize(size);
+  }
 }
 
-std::shared_ptr<moving_object> moving_object::find_closest_object(std::vector<std::shared_ptr<moving_object>> objects, std::string object_type) const
+void decision_buffer::store(entity e, const decision &d)
 {
-  int closest_object_idx = -1;
-  int closest_object_dist = (int)INFINITY;
+  this->x_pos[e] = d.x_pos;
+  this->y_pos[e] = d.y_pos;
+  this->x_vel[e] = d.x_vel;
+  this->y_vel[e] = d.y_vel;
+  this->properties[e] = d.properties;
+  for (std::size_t m = 0; m < max_moves; m++)
+  {
+    this->moves[m][e] = d.moves[m];
+    this->target_x[m][e] = d.target_x[m];
+    this->target_y[m][e] = d.target_y[m];
+  }
+}
 
-  for (int i = 0; i < objects.size(); i++)
+/* Ground */
+ground::ground(SDL_Surface *window_surface_ptr, unsigned threads, std::uint64_t seed, double tick_time)
+    : window_surface_ptr_{window_surface_ptr},
+      grid_{WINDOW_WIDTH, WINDOW_HEIGHT, TEXTURE_SIZE},
+      rng_{seed},
+      clock_{tick_time},
+      jobs_{threads}
+{
+  // The first systems only read the state before the step, the
+  // broadphase running alongside the decisions, then every system needs
+  // the previous one done
+  std::size_t snapshot = this->systems_.add([this] { this->snapshot_positions(); });
+  std::size_t rebuild = this->systems_.add([this] { this->grid_.rebuild(this->entities_); });
+  std::size_t contacts = this->systems_.add([this] { this->grid_.find_contacts(TEXTURE_SIZE, this->contacts_); });
+  std::size_t decisions = this->systems_.add([this] {
+    auto start = std::chrono::steady_clock::now();
+    this->update_decisions();
+    this->decision_time_ += std::chrono::steady_clock::now() - start;
+  });
+  std::size_t commit = this->systems_.add([this] { this->commit_decisions(); });
+  std::size_t interactions = this->systems_.add([this] { this->resolve_interactions(); });
+  std::size_t timers = this->systems_.add([this] { this->update_timers(); });
+  std::size_t commands = this->systems_.add([this] { this->apply_commands(); });
+
+  this->systems_.precede(snapshot, decisions);
+  this->systems_.precede(rebuild, decisions);
+  this->systems_.precede(decisions, commit);
+  this->systems_.precede(commit, interactions);
+  this->systems_.precede(rebuild, contacts);
+  this->systems_.precede(contacts, commit);
+  this->systems_.precede(interactions, timers);
+  this->systems_.precede(timers, commands);
+
+  // Indexed by species
+  static const char *sprite_paths[] = {
+      "../media/sheep.png",
+      "../media/wolf.png",
+      "../media/dog.png",
+      "../media/shepherd.png"};
+
+  for (auto path : sprite_paths)
   {
-    if ((objects[i]->has_property(object_type) || object_type.empty()) && (this != objects[i].get()))
+    if (window_surface_ptr == NULL)
     {
-      int dist = this->distance(*objects[i].get());
-
-      if (dist < closest_object_dist)
-      {
-        closest_object_dist = dist;
-        closest_object_idx = i;
-      }
+      break;
     }
+    this->sprites_.push_back(sprite_cache::global().load(path, window_surface_ptr));
   }
+}
 
-  return closest_object_idx != -1 ? objects[closest_object_idx] : NULL;
+ground::~ground()
+{
 }
 
-sheep::sheep(const std::string &file_path,
-             SDL_Surface *window_surface_ptr,
-             int x_pos, int y_pos,
-             int x_vel, int y_vel,
-             std::set<std::string> properties)
-    : animal{file_path, window_surface_ptr, x_pos, y_pos, x_vel, y_vel, properties}
+entity_handle ground::add_object(species kind, int x_pos, int y_pos, int x_vel, int y_vel)
 {
-  if (std::rand() % 100 < 50)
+  // Indexed by species
+  static const tag_set default_properties[] = {
+      tag_set({tag::sheep, tag::prey, tag::alive}),
+      tag_set({tag::wolf, tag::predator, tag::alive}),
+      tag_set({tag::dog, tag::alive}),
+      tag_set({tag::player, tag::alive})};
+
+  tag_set properties = default_properties[static_cast<int>(kind)];
+  if (kind == species::sheep)
   {
-    this->properties_.insert("male");
+    entity next = static_cast<entity>(this->entities_.size());
+    properties.insert(this->rng_.below(100, next, this->clock_.tick(), random_draw::sex) < 50 ? tag::male : tag::female);
   }
-  else
+
+  entity e = this->entities_.push_back(kind, x_pos, y_pos, x_vel, y_vel, properties, static_cast<sprite_id>(kind));
+  if (kind == species::wolf)
   {
-    this->properties_.insert("female");
+    this->entities_.starves_at[e] = this->clock_.tick() + this->clock_.ticks(starve_time);
+    this->timers_.schedule(this->entities_.handle[e], timer_event::starve, this->entities_.starves_at[e]);
   }
+
+  return this->entities_.handle[e];
 }
 
-// implement functions that are purely virtual in base class
-void sheep::move()
+void ground::set_target(entity_handle e, entity_handle target, int target_dist)
 {
-  if (this->has_property("fleeing"))
+  entity dense = this->entities_.find(e);
+  if (dense == no_entity)
   {
     return;
   }
 
-  this->x_pos_ += this->x_vel_;
-  this->y_pos_ += this->y_vel_;
+  this->entities_.target[dense] = target;
+  this->entities_.target_dist[dense] = target_dist;
+}
+
+void ground::kill(entity e)
+{
+  this->entities_.properties[e].insert(tag::dead);
+  this->commands_.kill(e);
+}
+
+void ground::snapshot_positions()
+{
+  this->entities_.previous_x_pos = this->entities_.x_pos;
+  this->entities_.previous_y_pos = this->entities_.y_pos;
+}
 
-  if (x_pos_ > WINDOW_WIDTH - TEXTURE_SIZE || x_pos_ < 0)
+void ground::update_players()
+{
+  // Nobody is at the keyboard of a headless run
+  if (this->window_surface_ptr_ == NULL)
   {
-    x_vel_ = -x_vel_;
+    return;
   }
-  if (y_pos_ > WINDOW_HEIGHT - TEXTURE_SIZE || y_pos_ < 0)
+
+  auto &es = this->entities_;
+  for (entity e = 0; e < es.size(); e++)
   {
-    y_vel_ = -y_vel_;
+    if (es.kind[e] == species::player)
+    {
+      keyboard_step(es.x_pos[e], es.y_pos[e], es.x_vel[e], es.y_vel[e], input_state::global());
+    }
   }
-};
+}
 
-void sheep::interact(interacting_object &object)
+void ground::update_timers()
 {
-  if (object.has_property("sheep"))
+  auto &es = this->entities_;
+
+  this->expired_.clear();
+  this->timers_.advance(this->clock_.tick(), this->expired_);
+
+  for (const timer &t : this->expired_)
   {
-    bool can_reproduce =
-        (!this->has_property("male") != !object.has_property("male")) && !this->has_property("infertile") && !object.has_property("infertile");
+    entity e = this->entities_.find(t.target);
+    if (e == no_entity)
+    {
+      continue;
+    }
 
-    if (can_reproduce)
+    switch (t.event)
     {
-      if (this->has_property("female"))
+    case timer_event::fertile:
+      es.properties[e].remove(tag::infertile);
+      break;
+    case timer_event::starve:
+      // Rescheduled by every meal, only the latest timer counts
+      if (es.starves_at[e] == t.due && !es.properties[e].has(tag::dead))
       {
-        this->insert_property("reproduced");
+        this->kill(e);
       }
-      else
+      break;
+    case timer_event::calm:
+      // Still chased: runs for another calm_time
+      if (es.properties[e].has(tag::chased))
       {
-        object.insert_property("reproduced");
+        this->timers_.schedule(t.target, timer_event::calm, this->clock_.tick() + this->clock_.ticks(calm_time));
+        break;
       }
+      es.properties[e].remove(tag::fleeing);
+      es.x_vel[e] = es.x_vel[e] < 0 ? -1 : 1;
+      es.y_vel[e] = es.y_vel[e] < 0 ? -1 : 1;
+      break;
     }
   }
 }
 
-wolf::wolf(const std::string &file_path,
-           SDL_Surface *window_surface_ptr,
-           int x_pos, int y_pos,
-           int x_vel, int y_vel,
-           int life,
-           std::set<std::string> properties)
-    : animal{file_path, window_surface_ptr, x_pos, y_pos, x_vel, y_vel, properties},
-      life_{life}
-{
-}
-
-// implement functions that are purely virtual in base class
-void wolf::move()
+void ground::apply_commands()
 {
-  if (this->has_property("hunting"))
+  if (!this->commands_.kills.empty())
   {
-    this->reduce_life(1);
-    if (this->get_life() < 1)
-    {
-      this->insert_property("dead");
-    }
+    this->entities_.erase(this->commands_.kills);
   }
-} // todo: Animals move around, but in a different
-  // fashion depending on which type of animal
 
-void wolf::interact(interacting_object &object)
-{
-  if (object.has_property("sheep"))
+  // Newborns only act from the next step on
+  for (auto &spawn : this->commands_.spawns)
   {
-    object.insert_property("dead");
-    this->increase_life(200);
+    this->add_object(spawn.kind, spawn.x_pos, spawn.y_pos);
   }
-}
 
-dog::dog(const std::string &file_path,
-         SDL_Surface *window_surface_ptr,
-         std::shared_ptr<moving_object> target_object,
-         int target_dist,
-         int x_vel, int y_vel,
-         std::set<std::string> properties)
-    : animal{file_path, window_surface_ptr,
-             target_dist, 0,
-             x_vel, y_vel, properties},
-      target_dist_{target_dist},
-      target_object_{target_object}
-{
+  this->commands_.clear();
 }
 
-void dog::move()
+void ground::interact(entity a, entity b)
 {
-  this->x_pos_ = target_dist_ * std::cos(this->x_vel_ * (SDL_GetTicks() / 200.0)) + this->target_object_->get_x_pos();
-  this->y_pos_ = target_dist_ * std::sin(this->y_vel_ * (SDL_GetTicks() / 200.0)) + this->target_object_->get_y_pos();
+  using effect = void (ground::*)(entity, entity);
+  constexpr std::size_t n = static_cast<std::size_t>(species::count);
+
+  // Row: species of a, column: species of b, nullptr when nothing happens
+  static constexpr effect interactions[n][n] = {
+      //  sheep               wolf     dog      player
+      {&ground::reproduce, nullptr, nullptr, nullptr}, // sheep
+      {&ground::eat, nullptr, nullptr, nullptr},       // wolf
+      {nullptr, nullptr, nullptr, nullptr},            // dog
+      {nullptr, nullptr, nullptr, nullptr}};           // player
+
+  effect e = interactions[static_cast<std::size_t>(this->entities_.kind[a])]
+                         [static_cast<std::size_t>(this->entities_.kind[b])];
+  if (e != nullptr)
+  {
+    (this->*e)(a, b);
+  }
 }
 
-void dog::interact(interacting_object &object)
+void ground::reproduce(entity a, entity b)
 {
-}
+  tag_set &self = this->entities_.properties[a];
+  tag_set &other = this->entities_.properties[b];
 
-/* Ground */
-ground::ground(SDL_Surface *window_surface_ptr) : window_surface_ptr_{window_surface_ptr}
-{
-}
+  bool can_reproduce =
+      (!self.has(tag::male) != !other.has(tag::male)) && !self.has(tag::infertile) && !other.has(tag::infertile);
 
-void ground::add_object(std::shared_ptr<moving_object> a)
-{
-  this->objects_.push_back(a);
+  if (can_reproduce)
+  {
+    std::uint64_t now = this->clock_.tick();
+    entity mother = self.has(tag::female) ? a : b;
+
+    // Drawn for the mother, who gives birth once at most per step as she
+    // turns infertile, unlike a that may meet several partners
+    this->commands_.spawn(species::sheep,
+                          this->rng_.below(WINDOW_WIDTH, mother, now, random_draw::birth_x),
+                          this->rng_.below(WINDOW_HEIGHT, mother, now, random_draw::birth_y));
+    this->entities_.properties[mother].insert(tag::infertile);
+
+    // Fertile again with the same chance every step, after fertility_rest
+    // on average
+    std::uint64_t rest = this->rng_.geometric(this->clock_.ticks(fertility_rest), mother, now, random_draw::fertility);
+    this->timers_.schedule(this->entities_.handle[mother], timer_event::fertile, now + 1 + rest);
+  }
 }
 
-void ground::update()
+void ground::eat(entity a, entity b)
 {
-  SDL_FillRect(this->window_surface_ptr_, NULL, 0x00FF00);
+  tag_set &self = this->entities_.properties[a];
 
-  for (int i = 0; i < this->objects_.size(); i++)
+  if (!self.has(tag::fed) && !this->entities_.properties[b].has(tag::dead))
   {
-    std::shared_ptr<moving_object> a = this->objects_[i];
+    this->kill(b);
+    this->entities_.starves_at[a] += this->clock_.ticks(starve_time);
+    this->timers_.schedule(this->entities_.handle[a], timer_event::starve, this->entities_.starves_at[a]);
+    self.insert(tag::fed);
+  }
+}
 
-    if (a->has_property("dead"))
+template <species kind>
+void ground::decide(entity e)
+{
+  static const tag_set wolf_lookups[] = {tag_set({tag::prey}), tag_set({tag::dog})};
+  static const tag_set sheep_lookups[] = {tag_set({tag::predator})};
+
+  const auto &es = this->entities_;
+  decision d{es.x_pos[e], es.y_pos[e], es.x_vel[e], es.y_vel[e], es.properties[e], {}, {}, {}};
+  std::size_t next_move = 0;
+  auto move_towards = [&d, &next_move](int x, int y) {
+    d.moves[next_move] = movement::towards;
+    d.target_x[next_move] = x;
+    d.target_y[next_move] = y;
+    next_move++;
+  };
+
+  if constexpr (kind == species::sheep)
+  {
+    if (d.properties.has(tag::fleeing))
     {
-      this->objects_.erase(this->objects_.begin() + i);
-      continue;
+      d.x_vel = d.x_vel < 0 ? -10 : 10;
+      d.y_vel = d.y_vel < 0 ? -10 : 10;
     }
 
-    if (a->has_property("reproduced"))
+    auto closest = this->grid_.find_closest_entities(es, e, sheep_lookups);
+    entity predator = closest[0];
+
+    if (predator != no_entity && distance(es, e, predator) < TEXTURE_SIZE * 2)
     {
-      std::shared_ptr<moving_object> new_sheep = std::make_shared<sheep>("../media/sheep.png", this->window_surface_ptr_, std::rand() % WINDOW_WIDTH, std::rand() % WINDOW_HEIGHT);
+      // Startled: runs for calm_time, then calms down unless still chased
+      d.properties.insert(tag::chased);
+      if (!d.properties.has(tag::fleeing))
+      {
+        d.properties.insert(tag::fleeing);
+        this->timers_.schedule(es.handle[e], timer_event::calm, this->clock_.tick() + this->clock_.ticks(calm_time));
+      }
 
-      this->add_object(new_sheep);
-      a->remove_property("reproduced");
-      a->insert_property("infertile");
+      move_towards(es.x_pos[predator] > d.x_pos ? 0 : WINDOW_WIDTH,
+                   es.y_pos[predator] > d.y_pos ? 0 : WINDOW_HEIGHT);
+    }
+    else
+    {
+      d.properties.remove(tag::chased);
+      d.moves[next_move++] = movement::bounce;
     }
+  }
+  else if constexpr (kind == species::wolf)
+  {
+    // Hungry again, for one prey per step
+    d.properties.remove(tag::fed);
+
+    auto closest = this->grid_.find_closest_entities(es, e, wolf_lookups);
 
-    if (a->has_property("infertile"))
+    if (entity prey = closest[0]; prey != no_entity)
     {
-      if (rand() % 10000 < 5)
+      move_towards(es.x_pos[prey], es.y_pos[prey]);
+      d.properties.insert(tag::hunting);
+    }
+    if (entity guard = closest[1]; guard != no_entity)
+    {
+      if (distance(es, e, guard) < TEXTURE_SIZE * 3)
       {
-        a->remove_property("infertile");
+        move_towards(es.x_pos[guard] > d.x_pos ? 0 : WINDOW_WIDTH,
+                     es.y_pos[guard] > d.y_pos ? 0 : WINDOW_HEIGHT);
       }
     }
-
-    if (a->has_property("fleeing"))
+  }
+  else if constexpr (kind == species::dog)
+  {
+    if (entity t = es.find(es.target[e]); t != no_entity)
     {
-      a->set_x_vel(10);
-      a->set_y_vel(10);
+      orbit(d.x_pos, d.y_pos, d.x_vel, d.y_vel, es.target_dist[e], es.x_pos[t], es.y_pos[t], this->clock_);
     }
+  }
+  // Players are moved from the keyboard, on the calling thread
 
-    auto closest_object = a->find_closest_object(this->objects_);
+  this->decisions_.store(e, d);
+}
 
-    if (a->distance(*closest_object.get()) < TEXTURE_SIZE)
+template <species kind>
+void ground::decide_species()
+{
+  const std::vector<entity> &members = this->by_species_[static_cast<std::size_t>(kind)];
+  this->jobs_.parallel_for(members.size(), [this, &members](std::size_t begin, std::size_t end) {
+    for (std::size_t i = begin; i < end; i++)
     {
-      a->interact(*closest_object.get());
+      this->decide<kind>(members[i]);
     }
+  });
+}
+
+void ground::decide(entity e)
+{
+  switch (this->entities_.kind[e])
+  {
+  case species::sheep:
+    this->decide<species::sheep>(e);
+    break;
+  case species::wolf:
+    this->decide<species::wolf>(e);
+    break;
+  case species::dog:
+    this->decide<species::dog>(e);
+    break;
+  default:
+    this->decide<species::player>(e);
+    break;
+  }
+}
+
+void ground::update_decisions()
+{
+  auto &ds = this->decisions_;
+  ds.resize(this->entities_.size());
 
-    if (a->has_property("wolf"))
+  auto integrate = [&ds](std::size_t begin, std::size_t end) {
+    for (std::size_t m = 0; m < max_moves; m++)
     {
-      if (auto closest_prey = a->find_closest_object(this->objects_, "prey"))
+      integrate_movement(ds.x_pos.data(), ds.y_pos.data(), ds.x_vel.data(), ds.y_vel.data(),
+                         ds.moves[m].data(), ds.target_x[m].data(), ds.target_y[m].data(), begin, end);
+    }
+  };
+
+  if (this->dispatch_ == dispatch::per_entity)
+  {
+    // Every range decides, then moves all its entities at once
+    this->jobs_.parallel_for(this->entities_.size(), [this, &integrate](std::size_t begin, std::size_t end) {
+      for (entity e = (entity)begin; e < end; e++)
       {
-        a->move_towards(closest_prey->get_x_pos(), closest_prey->get_y_pos());
-        a->insert_property("hunting");
+        this->decide(e);
       }
-      if (auto closest_dog = a->find_closest_object(this->objects_, "dog"))
-      {
-        int dist = a->distance(*closest_dog.get());
-        int dist_x = closest_dog->get_x_pos() - a->get_x_pos();
-        int dist_y = closest_dog->get_y_pos() - a->get_y_pos();
+      integrate(begin, end);
+    });
+    return;
+  }
 
-        if (dist < TEXTURE_SIZE * 3)
-        {
-          a->move_towards(
-              closest_dog->get_x_pos() > a->get_x_pos() ? 0 : WINDOW_WIDTH,
-              closest_dog->get_y_pos() > a->get_y_pos() ? 0 : WINDOW_HEIGHT);
-        }
-      }
-    }
+  // Each species decides in a pass of its own, with no switch per entity,
+  // then all the entities move at once
+  for (auto &members : this->by_species_)
+  {
+    members.clear();
+  }
+  for (entity e = 0; e < this->entities_.size(); e++)
+  {
+    this->by_species_[static_cast<std::size_t>(this->entities_.kind[e])].push_back(e);
+  }
 
-    if (a->has_property("sheep"))
-    {
-      if (auto closest_predator = a->find_closest_object(this->objects_, "predator"))
-      {
-        if (a->distance(*closest_predator.get()) < TEXTURE_SIZE * 2)
-        {
-          if (!a->has_property("fleeing"))
-          {
-            a->insert_property("fleeing");
-          }
+  this->decide_species<species::sheep>();
+  this->decide_species<species::wolf>();
+  this->decide_species<species::dog>();
+  this->decide_species<species::player>();
+  this->jobs_.parallel_for(this->entities_.size(), integrate);
+}
 
-          a->move_towards(
-              closest_predator->get_x_pos() > a->get_x_pos() ? 0 : WINDOW_WIDTH,
-              closest_predator->get_y_pos() > a->get_y_pos() ? 0 : WINDOW_HEIGHT);
-        }
-        else if (a->has_property("fleeing"))
-        {
-          a->remove_property("fleeing");
-          a->set_x_vel(1);
-          a->set_y_vel(1);
-        }
-      }
+void ground::commit_decisions()
+{
+  // The decided state becomes the current one, and the current one the
+  // buffer of the next decisions
+  auto &es = this->entities_;
+  es.x_pos.swap(this->decisions_.x_pos);
+  es.y_pos.swap(this->decisions_.y_pos);
+  es.x_vel.swap(this->decisions_.x_vel);
+  es.y_vel.swap(this->decisions_.y_vel);
+  es.properties.swap(this->decisions_.properties);
+}
+
+void ground::resolve_interactions()
+{
+  auto &es = this->entities_;
+
+  auto both_alive = [&es](const contact &c) {
+    return !es.properties[c.a].has(tag::dead) && !es.properties[c.b].has(tag::dead);
+  };
+
+  // Both ways, as the effect of a meeting depends on who meets whom
+  for (const contact &c : this->contacts_)
+  {
+    if (both_alive(c))
+    {
+      this->interact(c.a, c.b);
     }
+    if (both_alive(c))
+    {
+      this->interact(c.b, c.a);
+    }
+  }
+}
 
-    a->move();
-    a->draw(window_surface_ptr_);
+void ground::snapshot(world_snapshot &snapshot) const
+{
+  snapshot.sprites.clear();
+  if (this->window_surface_ptr_ == NULL)
+  {
+    return;
+  }
+
+  auto &es = this->entities_;
+  for (entity e = 0; e < es.size(); e++)
+  {
+    snapshot.sprites.push_back(world_snapshot::sprite{this->sprites_[es.sprite[e]].get(),
+                                                      es.previous_x_pos[e], es.previous_y_pos[e],
+                                                      es.x_pos[e], es.y_pos[e]});
   }
 }
 
-ground::~ground()
+void ground::step()
 {
+  this->systems_.run(this->jobs_);
+  this->update_players();
+  this->clock_.advance();
 }
 
 /* Application */
-application::application(unsigned n_sheep, unsigned n_wolf)
+application::application(unsigned n_sheep, unsigned n_wolf, bool headless, std::uint64_t seed, double tick_rate)
     : n_sheep_{n_sheep},
       n_wolf_{n_wolf},
-      window_ptr_{SDL_CreateWindow("Projet C++", 100, 100, WINDOW_WIDTH, WINDOW_HEIGHT, SDL_WINDOW_SHOWN)},
-      window_surface_ptr_{SDL_GetWindowSurface(this->window_ptr_)},
-      ground_{this->window_surface_ptr_},
-      window_event_{}
+      window_ptr_{headless ? NULL : SDL_CreateWindow("Projet C++", 100, 100, WINDOW_WIDTH, WINDOW_HEIGHT, SDL_WINDOW_SHOWN)},
+      window_surface_ptr_{headless ? NULL : SDL_GetWindowSurface(this->window_ptr_)},
+      ground_{this->window_surface_ptr_, 0, seed, 1. / tick_rate},
+      window_event_{},
+      renderer_{this->window_ptr_}
 {
-  for (int i = 0; i < n_sheep_; i++)
-  {
-    std::shared_ptr<moving_object> a_ptr = std::make_shared<sheep>("../media/sheep.png", this->window_surface_ptr_, std::rand() % (WINDOW_WIDTH - TEXTURE_SIZE), std::rand() % (WINDOW_HEIGHT - TEXTURE_SIZE));
-    this->ground_.add_object(a_ptr);
-  }
-  for (int i = 0; i < n_wolf_; i++)
+  // Placed before the first tick, each animal drawing with its entity id
+  const counter_rng &rng = this->ground_.rng();
+  for (unsigned i = 0; i < n_sheep_ + n_wolf_; i++)
   {
-    std::shared_ptr<moving_object> a_ptr = std::make_shared<wolf>("../media/wolf.png", this->window_surface_ptr_, std::rand() % (WINDOW_WIDTH - TEXTURE_SIZE), std::rand() % (WINDOW_HEIGHT - TEXTURE_SIZE), 2, 2);
-
-    this->ground_.add_object(a_ptr);
+    int x_pos = rng.below(WINDOW_WIDTH - TEXTURE_SIZE, i, 0, random_draw::place_x);
+    int y_pos = rng.below(WINDOW_HEIGHT - TEXTURE_SIZE, i, 0, random_draw::place_y);
+    if (i < n_sheep_)
+    {
+      this->ground_.add_object(species::sheep, x_pos, y_pos);
+    }
+    else
+    {
+      this->ground_.add_object(species::wolf, x_pos, y_pos, 2, 2);
+    }
   }
 
-  std::shared_ptr<moving_object> player_ptr = std::make_shared<playable_character>("../media/shepherd.png", this->window_surface_ptr_, 50, 50, 10, 10);
+  entity_handle player = this->ground_.add_object(species::player, 50, 50, 10, 10);
+  entity_handle dog = this->ground_.add_object(species::dog, 64, 0);
 
-  std::shared_ptr<moving_object> dog_ptr = std::make_shared<dog>("../media/dog.png", this->window_surface_ptr_, player_ptr, 64);
-
-  this->ground_.add_object(player_ptr);
-  this->ground_.add_object(dog_ptr);
+  this->ground_.set_target(dog, player, 64);
 }
 
 application::~application()
 {
-  SDL_DestroyWindow(this->window_ptr_);
+  if (this->window_ptr_ != NULL)
+  {
+    SDL_DestroyWindow(this->window_ptr_);
+  }
 }
 
 int application::loop(unsigned period)
 {
-  int ticks = 0;
-  while (ticks < (period)*1000)
+  const sim_clock &clock = this->ground_.clock();
+  const double tick_time = clock.tick_time();
+  const std::uint64_t steps = (std::uint64_t)(period / tick_time);
+  const std::uint64_t end = clock.tick() + steps;
+
+  if (this->window_ptr_ == NULL)
   {
-    ticks = SDL_GetTicks();
+    Uint32 start = SDL_GetTicks();
 
-    this->ground_.update();
-    SDL_UpdateWindowSurface(this->window_ptr_);
+    while (clock.tick() < end)
+    {
+      this->ground_.step();
+    }
+
+    std::cout << "Simulated " << steps << " steps in " << SDL_GetTicks() - start
+              << " ms, " << this->ground_.size() << " animals left" << std::endl;
+
+    return 0;
+  }
+
+  const double frequency = (double)SDL_GetPerformanceFrequency();
+
+  world_snapshot &first = this->snapshots_.back();
+  this->ground_.snapshot(first);
+  first.time = SDL_GetPerformanceCounter() / frequency;
+  this->snapshots_.publish();
+
+  // The steps run on their own thread, so that a slow frame never holds
+  // them back, while SDL stays on this one as it requires. Either side
+  // stops the other one when done or failing.
+  std::atomic<bool> stop{false};
+  std::exception_ptr step_failure, frame_failure;
+  std::thread simulation_thread([&] {
+    try
+    {
+      this->run_steps(stop, end);
+    }
+    catch (...)
+    {
+      step_failure = std::current_exception();
+    }
+    stop = true;
+  });
+
+  try
+  {
+    input_state &input = input_state::global();
+    while (!stop)
+    {
+      Uint64 now = SDL_GetPerformanceCounter();
+
+      // Input is read once per frame, whatever the number of steps
+      input.pump();
+      if (input.quit_requested())
+      {
+        break;
+      }
+      for (auto &event : input.events())
+      {
+        if (event.type == SDL_WINDOWEVENT &&
+            (event.window.event == SDL_WINDOWEVENT_EXPOSED || event.window.event == SDL_WINDOWEVENT_RESTORED))
+        {
+          this->renderer_.invalidate();
+        }
+      }
+
+      // The latest step, or the one of the previous frame if none came since
+      this->snapshots_.acquire();
+      const world_snapshot &snapshot = this->snapshots_.front();
+      double alpha = std::clamp((now / frequency - snapshot.time) / tick_time, 0.0, 1.0);
+
+      // Only the sprites that moved are redrawn and presented
+      snapshot.frame(alpha, this->frame_);
+      this->renderer_.present(view<const sprite_instance>(this->frame_));
+
+      // Leave the rest of the frame to the other processes
+      double spent = (SDL_GetPerformanceCounter() - now) / frequency;
+      if (spent < frame_time)
+      {
+        SDL_Delay((Uint32)((frame_time - spent) * 1000));
+      }
+    }
+  }
+  catch (...)
+  {
+    frame_failure = std::current_exception();
+  }
+
+  stop = true;
+  simulation_thread.join();
 
-    SDL_Delay(10);
+  if (step_failure)
+  {
+    std::rethrow_exception(step_failure);
+  }
+  if (frame_failure)
+  {
+    std::rethrow_exception(frame_failure);
   }
 
   return 0;
-}
\ No newline at end of file
+}
+
+void application::run_steps(std::atomic<bool> &stop, std::uint64_t end)
+{
+  const sim_clock &clock = this->ground_.clock();
+  const double tick_time = clock.tick_time();
+  const double frequency = (double)SDL_GetPerformanceFrequency();
+  Uint64 previous = SDL_GetPerformanceCounter();
+  double accumulator = 0;
+
+  while (clock.tick() < end && !stop)
+  {
+    Uint64 now = SDL_GetPerformanceCounter();
+    accumulator += (now - previous) / frequency;
+    previous = now;
+
+    // Falling behind, drop the time that can't be caught up with
+    accumulator = std::min(accumulator, max_steps_per_frame * tick_time);
+
+    bool stepped = false;
+    while (accumulator >= tick_time && clock.tick() < end)
+    {
+      this->ground_.step();
+      accumulator -= tick_time;
+      stepped = true;
+    }
+
+    if (stepped)
+    {
+      world_snapshot &snapshot = this->snapshots_.back();
+      this->ground_.snapshot(snapshot);
+      snapshot.time = now / frequency - accumulator;
+      this->snapshots_.publish();
+    }
+
+    // Leave the time until the next step to the other threads
+    double wait = tick_time - accumulator - (SDL_GetPerformanceCounter() - now) / frequency;
+    if (wait > 0)
+    {
+      SDL_Delay((Uint32)(wait * 1000));
+    }
+  }
+}
@@ -5,195 +5,717 @@
 
 #include <SDL.h>
 #include <SDL_image.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
 #include <iostream>
+#include <iterator>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <thread>
 #include <vector>
 #include <set>
 
 // Defintions
 constexpr double frame_rate = 60.0; // refresh rate
 constexpr double frame_time = 1. / frame_rate;
+constexpr double default_tick_rate = 60.0; // simulation steps per second
+// Most simulation steps run before drawing a frame, beyond which the
+// simulation slows down rather than never drawing again
+constexpr unsigned max_steps_per_frame = 10;
+// Simulated durations in seconds, turned into steps by sim_clock::ticks()
+// so that changing the tick rate rescales none of them against the others
+constexpr double calm_time = 1.0;             // a startled sheep runs this long, unless still chased
+constexpr double starve_time = 200 / 60.;     // a wolf starves this long after its last meal
+constexpr double fertility_rest = 2000 / 60.; // mean rest of a sheep after giving birth
 constexpr unsigned frame_width = 1400; // Width of window in pixel
 constexpr unsigned frame_height = 900; // Height of window in pixel
 // Minimal distance of animals to the border
 // of the screen
 constexpr unsigned frame_boundary = 100;
 
-// Helper function to initialize SDL
-void init();
+// Helper function to initialize SDL, without video nor image loading
+// when headless
+void init(bool headless = false);
 
-class interacting_object
+// Time of the simulation, which only advances by whole steps: what reads
+// it behaves the same however fast the steps run, be it a slow frame or
+// a headless run far faster than real time
+class sim_clock
 {
-protected:
-  std::set<std::string> properties_;
+private:
+  double tick_time_;       // simulated seconds per step
+  std::uint64_t tick_ = 0; // steps run so far
 
 public:
-  interacting_object(const std::set<std::string> properties = std::set<std::string>());
-  ~interacting_object(){};
+  explicit sim_clock(double tick_time = 1. / default_tick_rate) : tick_time_{tick_time} {};
+
+  void advance() { tick_++; };
+  std::uint64_t tick() const { return tick_; };
+  double tick_time() const { return tick_time_; };
+  double seconds() const { return tick_ * tick_time_; };
+  // Steps lasting about the given simulated time, one at least
+  std::uint64_t ticks(double seconds) const
+  {
+    std::uint64_t n = (std::uint64_t)(seconds / tick_time_ + 0.5);
+    return n > 0 ? n : 1;
+  };
+};
+
+// Non-owning view over contiguous elements (what std::span is in C++20),
+// used to hand the ground's storage to queries without copying it
+template <typename T>
+class view
+{
+private:
+  T *data_;
+  std::size_t size_;
 
-  virtual void interact(interacting_object &object){};
+public:
+  view(T *data, std::size_t size) : data_{data}, size_{size} {};
+  template <typename Container>
+  view(Container &container) : data_{std::data(container)}, size_{std::size(container)} {};
+
+  T *data() const { return data_; };
+  T *begin() const { return data_; };
+  T *end() const { return data_ + size_; };
+  std::size_t size() const { return size_; };
+  T &operator[](std::size_t i) const { return data_[i]; };
+};
 
-  void insert_property(std::string property) { properties_.insert(property); };
-  void remove_property(std::string property) { properties_.erase(property); };
-  bool has_property(const std::string key) { return properties_.find(key) != properties_.end(); };
+// Properties an object can have, interned as bit positions of a tag_set
+enum class tag : unsigned
+{
+  sheep,
+  wolf,
+  dog,
+  player,
+  prey,
+  predator,
+  alive,
+  male,
+  female,
+  fleeing,
+  chased, // a predator was within reach at the last decision
+  hunting,
+  infertile,
+  fed, // ate during the running step
+  dead,
+  count
 };
 
-class rendered_object : public interacting_object
+static_assert(static_cast<unsigned>(tag::count) <= 32, "tag_set holds at most 32 tags");
+
+// Fixed-width set of tags: every operation is a single bit operation
+class tag_set
 {
 private:
-  SDL_Surface *window_surface_ptr_;
-  SDL_Surface *image_ptr_;
+  std::uint32_t bits_;
 
-protected:
-  int x_pos_;
-  int y_pos_;
+  static constexpr std::uint32_t bit(tag t) { return std::uint32_t{1} << static_cast<unsigned>(t); };
 
 public:
-  rendered_object(
-      const std::string &file_path,
-      SDL_Surface *window_surface_ptr,
-      int x_pos = 0, int y_pos = 0,
-      std::set<std::string> properties = std::set<std::string>());
-  ~rendered_object();
+  constexpr tag_set() : bits_{0} {};
+  constexpr tag_set(std::initializer_list<tag> tags) : bits_{0}
+  {
+    for (tag t : tags)
+    {
+      bits_ |= bit(t);
+    }
+  };
+
+  constexpr bool has(tag t) const { return (bits_ & bit(t)) != 0; };
+  constexpr void insert(tag t) { bits_ |= bit(t); };
+  constexpr void remove(tag t) { bits_ &= ~bit(t); };
+
+  constexpr bool empty() const { return bits_ == 0; };
+  constexpr bool intersects(tag_set other) const { return (bits_ & other.bits_) != 0; };
+  constexpr std::uint32_t bits() const { return bits_; };
+};
+
+// Maximal number of object types looked up by one find_closest_entities
+// call. A lookup matches entities having any tag of its tag_set, an empty
+// tag_set matching every entity.
+constexpr std::size_t max_lookups = 4;
 
-  virtual void interact(interacting_object &object){};
+// Images decoded (and prepared for the window) once per path and shared by everything drawing them.
+// The cache only keeps weak references: an image is freed once the last
+// object using it is gone, and decoded again if it is needed later.
+class sprite_cache
+{
+private:
+  // By path and pixel format of the window it was prepared for
+  // (SDL_PIXELFORMAT_UNKNOWN without one)
+  std::map<std::pair<std::string, Uint32>, std::weak_ptr<SDL_Surface>> surfaces_;
 
-  int get_x_pos() const { return x_pos_; };
-  int get_y_pos() const { return y_pos_; };
+public:
+  std::shared_ptr<SDL_Surface> load(const std::string &path, SDL_Surface *window_surface_ptr);
 
-  void draw(SDL_Surface *window_surface_ptr);
+  // The cache shared by the whole application
+  static sprite_cache &global();
 };
 
-class moving_object : public rendered_object
+// Keyboard and window input, drained from SDL once per frame by the
+// application loop: a table of the keys held down plus the events of the
+// frame, for the player and any other consumer to read. The keys can be
+// read from the simulation thread while the main thread pumps.
+class input_state
 {
-protected:
-  int x_vel_;
-  int y_vel_;
+private:
+  std::array<std::atomic<bool>, SDL_NUM_SCANCODES> keys_down_{};
+  std::vector<SDL_Event> events_;
+  bool quit_ = false;
 
 public:
-  moving_object(
-      const std::string &file_path,
-      SDL_Surface *window_surface_ptr,
-      int x_pos = 0, int y_pos = 0,
-      int x_vel = 1, int y_vel = 1,
-      std::set<std::string> properties = std::set<std::string>());
-  ~moving_object(){};
-
-  void set_x_vel(int x_vel) { x_vel_ = x_vel; };
-  void set_y_vel(int y_vel) { y_vel_ = y_vel; };
+  // Empties the whole SDL event queue
+  void pump();
 
-  int get_x_vel() const { return x_vel_; }
-  int get_y_vel() const { return y_vel_; }
+  bool is_down(SDL_Keycode key) const;
+  bool quit_requested() const { return quit_; };
+  // Events of the last pump(), in order
+  view<const SDL_Event> events() const { return view<const SDL_Event>(events_); };
 
-  virtual void interact(interacting_object &object){};
-  virtual void move(){};
+  // The input of the whole application, as SDL has a single event queue
+  static input_state &global();
+};
 
-  std::shared_ptr<moving_object> find_closest_object(std::vector<std::shared_ptr<moving_object>> objects, std::string object_type = "") const;
-  void move_towards(const int x, const int y);
-  int distance(moving_object &object) const;
-  // int step(); ??
+// One image to draw, at a rectangle of the window
+struct sprite_instance
+{
+  SDL_Surface *image;
+  SDL_Rect rect;
 };
 
-class playable_character : public moving_object
+// Draws frames of sprites on a window, redrawing and presenting only the
+// regions that changed since the previous frame: the rectangles of the
+// sprites that appeared, moved or vanished, restored from a cached
+// background before the sprites over them are drawn again
+class renderer
 {
-public:
-  playable_character(
-      const std::string &file_path,
-      SDL_Surface *window_surface_ptr,
-      int x_pos = 0, int y_pos = 0,
-      int x_vel = 1, int y_vel = 1,
-      std::set<std::string> properties = std::set<std::string>({"player", "alive"}));
-  ~playable_character(){};
+private:
+  // Non-owning, NULL when headless: nothing is drawn then
+  SDL_Window *window_ptr_;
+  SDL_Surface *window_surface_ptr_;
+  // The empty ground, in the pixel format of the window
+  std::shared_ptr<SDL_Surface> background_;
+
+  std::vector<sprite_instance> shown_; // last frame, sorted
+  std::vector<sprite_instance> next_;  // frame being presented, sorted
+  std::vector<SDL_Rect> dirty_;
+  bool full_; // redraw everything at the next frame
 
-  virtual void interact(interacting_object &object){};
+  void draw_region(view<const sprite_instance> sprites, const SDL_Rect &region);
 
-  void move();
+public:
+  // Past this many changed rectangles, a frame is redrawn as a whole
+  static constexpr std::size_t max_dirty_rects = 64;
+
+  renderer(SDL_Window *window_ptr);
+  ~renderer(){};
+
+  // Draws the sprites, in order, and shows them on the window
+  void present(view<const sprite_instance> sprites);
+  // Makes the next present() redraw the whole window, which is needed
+  // once the window was uncovered or restored
+  void invalidate() { full_ = true; };
+  // Regions presented by the last present(), the whole window if it was
+  // redrawn as a whole
+  view<const SDL_Rect> dirty_rects() const { return view<const SDL_Rect>(dirty_); };
+};
+
+// Sprites of the ground around a step, positions before and after it, for
+// frames to be drawn from while the simulation goes on
+struct world_snapshot
+{
+  struct sprite
+  {
+    SDL_Surface *image;
+    int previous_x_pos, previous_y_pos;
+    int x_pos, y_pos;
+  };
+
+  std::vector<sprite> sprites;
+  // Performance counter time, in seconds, from which the step is shown
+  double time = 0;
+
+  // The sprites in drawing order, alpha in [0, 1] interpolating between
+  // the positions before and after the step
+  void frame(double alpha, std::vector<sprite_instance> &instances) const;
 };
 
-class animal : public moving_object
+// Lock-free exchange of the latest value between one writer and one
+// reader: the writer fills back() then publishes it, the reader takes the
+// last published value as front(). Neither ever waits for the other, and
+// values published faster than they are taken are dropped.
+template <typename T>
+class triple_buffer
 {
+private:
+  // Set on the middle index while the value it holds was not taken yet
+  static constexpr unsigned fresh = 4;
+
+  std::array<T, 3> buffers_;
+  unsigned back_ = 0;
+  std::atomic<unsigned> middle_{1};
+  unsigned front_ = 2;
+
 public:
-  animal(
-      const std::string &file_path,
-      SDL_Surface *window_surface_ptr,
-      int x_pos = 0, int y_pos = 0,
-      int x_vel = 0, int y_vel = 0,
-      std::set<std::string> properties = std::set<std::string>());
-  ~animal(){};
+  T &back() { return buffers_[back_]; };
+  void publish()
+  {
+    back_ = middle_.exchange(back_ | fresh, std::memory_order_acq_rel) & ~fresh;
+  };
+
+  // Moves the last published value to front(), if not taken already
+  bool acquire()
+  {
+    if ((middle_.load(std::memory_order_relaxed) & fresh) == 0)
+    {
+      return false;
+    }
+    front_ = middle_.exchange(front_, std::memory_order_acq_rel) & ~fresh;
+    return true;
+  };
+  const T &front() const { return buffers_[front_]; };
+};
 
-  virtual void interact(interacting_object &object){};
-  virtual void move(){};
+// What a random number is drawn for, so that an entity drawing several
+// numbers in the same tick gets independent ones
+enum class random_draw : std::uint32_t
+{
+  sex,
+  birth_x,
+  birth_y,
+  fertility,
+  place_x,
+  place_y
 };
 
-class sheep : public animal
+// Counter-based random numbers (a SplitMix64 stream): a number only
+// depends on the seed and on the (id, tick, draw) it is drawn for, not on
+// what was drawn before. Threads can draw in any order without sharing
+// any state, and a seed replays bit-identically on every platform.
+class counter_rng
 {
+private:
+  std::uint64_t seed_;
+
 public:
-  sheep(
-      const std::string &file_path,
-      SDL_Surface *window_surface_ptr,
-      int x_pos = 0, int y_pos = 0,
-      int x_vel = 1, int y_vel = 1,
-      std::set<std::string> properties = std::set<std::string>({"sheep", "prey", "alive"}));
-  ~sheep(){};
+  explicit counter_rng(std::uint64_t seed = 0) : seed_{seed} {};
+
+  std::uint64_t seed() const { return seed_; };
+  std::uint64_t bits(std::uint64_t id, std::uint64_t tick, random_draw draw) const;
+  // Uniform in [0, bound)
+  std::uint32_t below(std::uint32_t bound, std::uint64_t id, std::uint64_t tick, random_draw draw) const;
+  // Steps before an event with a chance of 1 in mean (at least 1) per
+  // step, drawn at once: geometric, in integer arithmetic only
+  std::uint64_t geometric(std::uint64_t mean, std::uint64_t id, std::uint64_t tick, random_draw draw) const;
+};
 
-  void interact(interacting_object &object);
+// Species of an entity of the ground, selecting the systems driving it
+enum class species : std::uint8_t
+{
+  sheep,
+  wolf,
+  dog,
+  player,
+  count
+};
+
+// Index of an entity in the entity_store of the ground, which moves when
+// entities before it are erased: only valid within a step
+using entity = std::uint32_t;
+constexpr entity no_entity = ~entity{0};
+
+// Reference to an entity that survives the erasing of others, to hold
+// across steps: a slot following the entity through the store, and the
+// generation of the slot, which moves on once the entity is gone so that
+// outdated handles find nothing
+struct entity_handle
+{
+  std::uint32_t slot;
+  std::uint32_t generation;
+
+  bool operator==(const entity_handle &other) const { return slot == other.slot && generation == other.generation; };
+  bool operator!=(const entity_handle &other) const { return !(*this == other); };
+  bool operator<(const entity_handle &other) const
+  {
+    return slot != other.slot ? slot < other.slot : generation < other.generation;
+  };
+};
+constexpr entity_handle no_handle{~std::uint32_t{0}, 0};
 
-  void move();
+// Index of a sprite in the sprite table of the ground
+using sprite_id = std::uint32_t;
+
+using closest_entities = std::array<entity, max_lookups>;
+
+// Structure-of-arrays storage of the entities of the ground: every
+// component lives in its own contiguous array, indexed by entity, so the
+// systems walk plain arrays instead of chasing pointers. The arrays are
+// also the pool of all entities: erasing keeps their capacity for the
+// next births, so a population staying under its peak never allocates.
+struct entity_store
+{
+  std::vector<species> kind;
+  std::vector<int> x_pos;
+  std::vector<int> y_pos;
+  std::vector<int> previous_x_pos; // before the last step, to draw in between
+  std::vector<int> previous_y_pos;
+  std::vector<int> x_vel;
+  std::vector<int> y_vel;
+  std::vector<tag_set> properties;
+  std::vector<std::uint64_t> starves_at; // tick, wolves only
+  std::vector<entity_handle> target;     // dogs only
+  std::vector<int> target_dist;          // dogs only
+  std::vector<sprite_id> sprite;
+  std::vector<entity_handle> handle;
+
+  std::size_t size() const { return kind.size(); };
+
+  entity push_back(species k, int x, int y, int x_v, int y_v, tag_set props, sprite_id s);
+  // Erases the given entities (duplicates allowed) in a single compaction
+  // pass, keeping the others in order
+  void erase(view<const entity> doomed);
+  // The entity a handle refers to, or no_entity once it was erased
+  entity find(entity_handle h) const
+  {
+    return h.slot < slots_.size() && slots_[h.slot].generation == h.generation ? slots_[h.slot].dense : no_entity;
+  };
+
+private:
+  struct slot
+  {
+    entity dense;
+    std::uint32_t generation;
+  };
+
+  std::vector<slot> slots_;
+  std::vector<std::uint32_t> free_slots_; // of erased entities, reused first
+  std::vector<entity> remap_;             // scratch space of erase()
 };
 
-// Insert here:
-// class wolf, derived from animal
-// Use only sheep at first. Once the application works
-// for sheep you can add the wolves
-class wolf : public animal
+// Spawns and kills requested while a step runs, applied together at its
+// end, so the entity arrays never change under the systems walking them
+struct command_buffer
 {
+  struct spawn_command
+  {
+    species kind;
+    int x_pos;
+    int y_pos;
+  };
+
+  std::vector<entity> kills;
+  std::vector<spawn_command> spawns;
+
+  void kill(entity e) { kills.push_back(e); };
+  void spawn(species kind, int x_pos, int y_pos) { spawns.push_back(spawn_command{kind, x_pos, y_pos}); };
+  void clear()
+  {
+    kills.clear();
+    spawns.clear();
+  };
+};
+
+// State changes of an entity that happen at a given tick
+enum class timer_event : std::uint8_t
+{
+  fertile, // end of the rest of a sheep after giving birth
+  starve,  // a wolf's last meal is too far, unless it ate since
+  calm     // end of the run of a startled sheep
+};
+
+struct timer
+{
+  std::uint64_t due; // tick
+  entity_handle target;
+  timer_event event;
+};
+
+// Hierarchical timing wheel: a timer sits in one of the slots of the
+// wheel of its level, coarser the further it is due, and moves down a
+// level as its time comes. Scheduling is constant time and a tick with
+// nothing due only looks at one empty slot, so entities waiting for a
+// state change cost nothing until then.
+// The slots are lists linked through a pool of nodes, whose free ones are
+// reused first: the pool only grows past the most timers ever pending.
+class timer_wheel
+{
+private:
+  static constexpr int slot_bits = 6;
+  static constexpr std::size_t slots = std::size_t{1} << slot_bits;
+  static constexpr int levels = 4; // timers further away wait in the last one
+  static constexpr std::uint32_t no_node = ~std::uint32_t{0};
+
+  struct node
+  {
+    timer t;
+    std::uint32_t next;
+  };
+
+  std::vector<node> nodes_;
+  std::uint32_t free_ = no_node; // list of the unused nodes
+  std::array<std::uint32_t, slots * levels> wheels_ = make_wheels();
+  std::uint64_t now_ = 0; // last tick expired
+  std::size_t size_ = 0;
+  std::mutex mutex_;
+
+  static constexpr std::array<std::uint32_t, slots * levels> make_wheels()
+  {
+    std::array<std::uint32_t, slots * levels> wheels{};
+    for (auto &head : wheels)
+    {
+      head = no_node;
+    }
+    return wheels;
+  };
+  void link(std::uint32_t n); // into the slot where nodes_[n] is due
+
 public:
-  // todo
-  // Ctor
-  wolf(
-      const std::string &file_path,
-      SDL_Surface *window_surface_ptr,
-      int x_pos = 0, int y_pos = 0,
-      int x_vel = 1, int y_vel = 1,
-      int life = 200,
-      std::set<std::string> properties = std::set<std::string>({"wolf", "predator", "alive"}));
-  // Dtor
-  ~wolf(){};
-  // implement functions that are purely virtual in base class
-  int get_life() const { return life_; };
-  void increase_life(int k) { life_ += k; };
-  void reduce_life(int k) { life_ -= k; };
-
-  void interact(interacting_object &object);
-  void move();
+  // Safe to call from several threads at once
+  void schedule(entity_handle target, timer_event event, std::uint64_t due);
+  // Expires the timers due up to tick, appending them to expired ordered
+  // by due tick, entity and event whatever order they were scheduled in.
+  // The timers of erased entities expire too, finding no entity.
+  void advance(std::uint64_t tick, std::vector<timer> &expired);
+  std::size_t size() const { return size_; };
+};
+
+// Two entities close enough to interact, a < b
+struct contact
+{
+  entity a;
+  entity b;
+};
 
+// Uniform grid bucketing the entities of the ground by position, so that
+// nearest-entity queries only scan the cells around the querying entity
+// instead of every entity.
+class spatial_grid
+{
 private:
-  int life_;
+  int cell_size_;
+  int columns_;
+  int rows_;
+  // Copies of the entities sorted by cell, the cell c spanning
+  // [cell_start_[c], cell_start_[c + 1]), so that the cells of a row are
+  // contiguous too and scanned by the nearest-point kernel in one go
+  std::vector<std::uint32_t> cell_start_;
+  std::vector<entity> ids_;
+  std::vector<int> x_pos_;
+  std::vector<int> y_pos_;
+  std::vector<tag_set> properties_;
+  std::vector<int> cell_of_;
+  // Every coordinate fits the 16-bit lanes of the kernel
+  bool narrow_;
+
+  int cell_index(int x_pos, int y_pos) const;
+
+public:
+  spatial_grid(int width, int height, int cell_size);
+  ~spatial_grid(){};
+
+  void rebuild(const entity_store &entities);
+
+  // Same result as a linear scan over every entity: the nearest one
+  // matching object_types by squared distance (lowest entity on ties),
+  // or no_entity.
+  entity find_closest_entity(const entity_store &entities, entity from, tag_set object_types = tag_set()) const;
+  // Multi-type variant, scanning the neighbouring cells once for all types
+  closest_entities find_closest_entities(const entity_store &entities, entity from, view<const tag_set> lookups) const;
+  // Broadphase: every pair of entities closer than radius, which must not
+  // exceed the cell size, cell by cell in row order
+  void find_contacts(int radius, std::vector<contact> &contacts) const;
+};
+
+// Number of jobs of a group still to run, which a thread can wait on
+// while helping to run them
+struct job_counter
+{
+  std::atomic<std::size_t> pending{0};
 };
 
-class dog : public animal
+// Work-stealing job system. Every thread owns a deque of jobs: it pushes
+// and pops its own jobs at the back, while idle threads steal the oldest,
+// largest ones at the front. Each deque has its own lock, so threads only
+// contend when one of them steals from another. Threads outside of the
+// system (the one calling ground::step) share the first deque.
+class job_system
 {
 public:
-  // todo
-  // Ctor
-  dog(
-      const std::string &file_path,
-      SDL_Surface *window_surface_ptr,
-      std::shared_ptr<moving_object>,
-      int target_dist = 128,
-      int x_vel = 1, int y_vel = 1,
-      std::set<std::string> properties = std::set<std::string>({"dog", "alive"}));
-  // Dtor
-  ~dog(){};
-  // implement functions that are purely virtual in base class
-  void interact(interacting_object &object);
-  void move();
+  using range_body = std::function<void(std::size_t, std::size_t)>;
 
 private:
-  std::shared_ptr<moving_object> target_object_;
-  int target_dist_;
+  struct job
+  {
+    const range_body *body;
+    std::size_t begin;
+    std::size_t end;
+    std::size_t grain; // larger ranges are split in halves before running
+    job_counter *counter;
+  };
+
+  // Growable ring buffer of jobs. Once grown to the deepest queue seen,
+  // pushing and popping never allocate, where a std::deque allocates and
+  // frees its blocks as jobs come and go.
+  class job_ring
+  {
+  private:
+    std::vector<job> slots_; // a power of two of them
+    std::size_t head_ = 0;   // oldest job
+    std::size_t size_ = 0;
+
+  public:
+    bool empty() const { return size_ == 0; };
+    void push_back(const job &j);
+    job pop_back();
+    job pop_front();
+  };
+
+  struct alignas(64) queue
+  {
+    std::mutex mutex;
+    job_ring jobs;
+  };
+
+  std::vector<std::thread> workers_;
+  std::unique_ptr<queue[]> queues_; // one per worker, plus the first one
+  unsigned queue_count_;
+  std::atomic<std::size_t> queued_;
+  std::atomic<unsigned> sleeping_;
+  std::mutex sleep_mutex_;
+  std::condition_variable wake_;
+  bool stopping_;
+
+  unsigned own_queue() const;
+  void push(const job &j);
+  bool pop(job &j); // from the own deque, or stolen from another one
+  void run(job j);
+  void work(unsigned index);
+
+public:
+  // 0 threads means one per hardware thread, the calling thread included
+  job_system(unsigned threads = 0);
+  ~job_system();
+
+  unsigned size() const { return queue_count_; };
+
+  // Queues body(begin, end), split down to grain sized ranges
+  void submit(const range_body &body, std::size_t begin, std::size_t end, job_counter &counter, std::size_t grain = 1);
+  // Runs queued jobs until every job counted by counter is done
+  void wait(job_counter &counter);
+
+  // Runs body(begin, end) over consecutive ranges covering [0, count),
+  // stolen by idle threads in halves, and returns once they are all done.
+  // grain defaults to a few ranges per thread.
+  void parallel_for(std::size_t count, const range_body &body, std::size_t grain = 0);
+};
+
+// Jobs and the order between them, built once and run as many times as
+// needed: a job starts as soon as every job preceding it is done
+class task_graph
+{
+private:
+  struct node
+  {
+    std::function<void()> work;
+    std::vector<std::size_t> successors;
+    std::size_t dependencies;
+    std::atomic<std::size_t> remaining;
+    job_system::range_body body; // work, then release the successors
+  };
+
+  std::vector<std::unique_ptr<node>> nodes_;
+  job_system *jobs_; // of the running run()
+  job_counter counter_;
+
+public:
+  task_graph() : jobs_{nullptr} {};
+  task_graph(const task_graph &) = delete;
+  task_graph &operator=(const task_graph &) = delete;
+
+  std::size_t add(std::function<void()> work);
+  void precede(std::size_t before, std::size_t after);
+  void run(job_system &jobs);
+};
+
+// How an entity moves once it decided, integrated for whole arrays of
+// entities at once
+enum class movement : std::uint8_t
+{
+  stay,    // already placed, or not moving
+  bounce,  // straight line at its velocity, bouncing on the borders
+  towards, // step towards a point, at the speed of its velocity
+};
+
+// Moves that an entity makes one after the other in a step
+constexpr std::size_t max_moves = 2;
+
+// What an entity decided to do during the read phase of a step, from the
+// state of the ground before the step
+struct decision
+{
+  int x_pos;
+  int y_pos;
+  int x_vel;
+  int y_vel;
+  tag_set properties;
+  std::array<movement, max_moves> moves;
+  std::array<int, max_moves> target_x; // of the towards moves
+  std::array<int, max_moves> target_y;
+};
+
+// The decisions of all the entities, one array per field like the
+// entity_store, for the movement kernel to run over
+struct decision_buffer
+{
+  std::vector<int> x_pos;
+  std::vector<int> y_pos;
+  std::vector<int> x_vel;
+  std::vector<int> y_vel;
+  std::vector<tag_set> properties;
+  std::array<std::vector<movement>, max_moves> moves;
+  std::array<std::vector<int>, max_moves> target_x;
+  std::array<std::vector<int>, max_moves> target_y;
+
+  void resize(std::size_t size);
+  void store(entity e, const decision &d);
+};
+
+// Batched kernels of the systems: 4 or 8 entities at a time with SSE2 or
+// AVX2 when the build targets them (and NO_SIMD is not defined), one at a
+// time otherwise, with the same results either way.
+
+// Moves the entities [begin, end) of the arrays by their move: a straight
+// line bouncing on the borders, or a step towards the target at the speed
+// of their velocity
+void integrate_movement(int *x_pos, int *y_pos, int *x_vel, int *y_vel,
+                        const movement *moves, const int *target_x, const int *target_y,
+                        std::size_t begin, std::size_t end);
+// Nearest point to (x, y) among [begin, end) of the arrays by squared
+// distance, lowest id on ties, leaving out skip and the points without
+// any tag of object_types (unless empty). best and best_dist2 carry the
+// result from call to call. The SIMD path needs narrow: coordinates in
+// [-16384, 16383], so that squared distances fit 32-bit lanes.
+void nearest_point(const int *x_pos, const int *y_pos, const tag_set *properties, const entity *ids,
+                   std::size_t begin, std::size_t end, int x, int y, tag_set object_types, entity skip,
+                   bool narrow, entity &best, std::int64_t &best_dist2);
+
+// How the read phase reaches the behaviour of each species: one pass per
+// species over the entities of that species, each pass compiled for it
+// alone, or a switch on the species of every entity in a single pass
+// (what the passes replaced, kept to measure them against)
+enum class dispatch : std::uint8_t
+{
+  per_species,
+  per_entity
 };
 
 // The "ground" on which all the animals live (like the std::vector
@@ -201,26 +723,89 @@ private:
 class ground
 {
 private:
-  // Attention, NON-OWNING ptr, again to the screen
+  // Attention, NON-OWNING ptr, again to the screen. NULL when headless:
+  // nothing is loaded nor drawn then.
   SDL_Surface *window_surface_ptr_;
 
-  // Some attribute to store all the wolves and sheep
-  // here
-  std::vector<std::shared_ptr<moving_object>> objects_;
+  // All the wolves, sheep, dogs and players, one component per array
+  entity_store entities_;
+
+  // One image per species, from the sprite_cache
+  std::vector<std::shared_ptr<SDL_Surface>> sprites_;
+
+  // Spatial index over entities_, rebuilt every step()
+  spatial_grid grid_;
+
+  // Births and deaths of the running step
+  command_buffer commands_;
+
+  // Random numbers of the simulation, keyed by entity and clock_ tick
+  counter_rng rng_;
+  sim_clock clock_; // advanced by step()
+
+  // Timed state changes, and the ones expiring during the running step
+  timer_wheel timers_;
+  std::vector<timer> expired_;
+
+  // A step first lets every entity decide from the unchanged entities_
+  // (read phase), then commits all decisions at once (write phase). The
+  // outcome is the same whatever the number of threads of the system.
+  job_system jobs_;
+  decision_buffer decisions_; // back buffer, one per entity
+  dispatch dispatch_ = dispatch::per_species;
+  std::chrono::steady_clock::duration decision_time_{}; // spent in update_decisions()
+  // The entities of each species in id order, regrouped every step
+  std::array<std::vector<entity>, static_cast<std::size_t>(species::count)> by_species_;
+  std::vector<contact> contacts_;   // pairs within TEXTURE_SIZE before the step
+
+  // The simulation systems, run by step() through systems_
+  void snapshot_positions();
+  void update_decisions();     // read phase: lookups, steering and movement
+  void commit_decisions();     // write phase, swapping the buffers
+  void resolve_interactions(); // in contact order, as they touch two entities
+  void update_timers();        // state changes due this step
+  void apply_commands(); // deaths and births queued by the systems above
+  void update_players(); // keyboard, on the thread calling step()
+  task_graph systems_;
+
+  // The read phase of one entity, for a species known at compile time
+  template <species kind>
+  void decide(entity e);
+  template <species kind>
+  void decide_species(); // of every entity of the species
+  void decide(entity e); // switching on its species
+  // Dispatches on the species of both entities to one of the effects below
+  void interact(entity a, entity b);
+  void reproduce(entity a, entity b);
+  void eat(entity a, entity b);
+  // Tags e dead right away and removes it at the end of the step
+  void kill(entity e);
 
 public:
-  ground(SDL_Surface *window_surface_ptr);           // todo: Ctor
-  ~ground();                                         // todo: Dtor, again for clean up (if necessary)
-  void add_object(std::shared_ptr<moving_object> a); // todo: Add an animal
-  void update();                                     // todo: "refresh the screen": Move animals and draw them
-  // Possibly other methods, depends on your implementation
+  ground(SDL_Surface *window_surface_ptr, unsigned threads = 0, std::uint64_t seed = 0,
+         double tick_time = 1. / default_tick_rate);
+  ~ground();
+  entity_handle add_object(species kind, int x_pos, int y_pos, int x_vel = 1, int y_vel = 1);
+  // Makes a dog circle around target at target_dist, until target dies
+  void set_target(entity_handle e, entity_handle target, int target_dist);
+  void step();   // Move animals, without drawing anything
+  // The same outcome either way, only the speed differs
+  void set_dispatch(dispatch d) { dispatch_ = d; };
+  // Time spent deciding, over all the steps so far
+  std::chrono::steady_clock::duration decision_time() const { return decision_time_; };
+  // The sprites of the animals around the last step, in drawing order
+  void snapshot(world_snapshot &snapshot) const;
+  std::size_t size() const { return entities_.size(); };
+  const counter_rng &rng() const { return rng_; };
+  const sim_clock &clock() const { return clock_; };
+  const entity_store &entities() const { return entities_; };
 };
 
 // The application class, which is in charge of generating the window
 class application
 {
 private:
-  // The following are OWNING ptrs
+  // The following are OWNING ptrs, NULL when headless
   SDL_Window *window_ptr_;
   SDL_Surface *window_surface_ptr_;
   SDL_Event window_event_;
@@ -230,14 +815,30 @@ private:
   unsigned n_wolf_;
   ground ground_;
 
+  // The ground as last stepped, from the simulation thread to the thread
+  // calling loop(), which alone uses SDL and the renderer
+  triple_buffer<world_snapshot> snapshots_;
+  renderer renderer_;
+  std::vector<sprite_instance> frame_;
+
+  // Simulation thread: steps as the elapsed time calls for, publishing a
+  // snapshot after each round of them, until the end tick or stop
+  void run_steps(std::atomic<bool> &stop, std::uint64_t end);
+
 public:
-  application(unsigned n_sheep, unsigned n_wolf); // Ctor
-  ~application();                                 // dtor
+  // The same seed replays the same simulation
+  application(unsigned n_sheep, unsigned n_wolf, bool headless = false,
+              std::uint64_t seed = 0,
+              double tick_rate = default_tick_rate); // Ctor
+  ~application();                                    // dtor
 
   int loop(unsigned period); // main loop of the application.
-                             // this ensures that the screen is updated
-                             // at the correct rate.
-                             // See SDL_GetTicks() and SDL_Delay() to enforce a
-                             // duration the application should terminate after
-                             // 'period' seconds
+                             // The simulation advances by fixed steps of
+                             // the ground clock, as many as the elapsed time
+                             // calls for, on a thread of their own, while
+                             // the calling thread reads the input and
+                             // draws frames at frame_rate from snapshots
+                             // of the steps. It terminates after
+                             // 'period' simulated seconds, which a headless
+                             // application runs as fast as possible
 };
\ No newline at end of file
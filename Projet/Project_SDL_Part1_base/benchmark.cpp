@@ -0,0 +1,89 @@
+#include "Project_SDL1.h"
+#include <chrono>
+#include <string>
+
+// Times a headless ground deciding in one pass per species
+// (dispatch::per_species) against the same ground switching on the
+// species of every entity (dispatch::per_entity): the decisions alone,
+// then whole steps, which contacts and interactions weigh on too. Checks
+// that both reach the same state.
+//
+// Usage: SDL_part1_benchmark [sheep] [wolves] [steps] [threads]
+
+namespace
+{
+  // Where the application places animals: the window less a sprite
+  constexpr std::uint32_t area_width = 640 - 64;
+  constexpr std::uint32_t area_height = 480 - 64;
+
+  void populate(ground &g, unsigned n_sheep, unsigned n_wolf)
+  {
+    const counter_rng &rng = g.rng();
+    for (unsigned i = 0; i < n_sheep + n_wolf; i++)
+    {
+      int x_pos = rng.below(area_width, i, 0, random_draw::place_x);
+      int y_pos = rng.below(area_height, i, 0, random_draw::place_y);
+      if (i < n_sheep)
+      {
+        g.add_object(species::sheep, x_pos, y_pos);
+      }
+      else
+      {
+        g.add_object(species::wolf, x_pos, y_pos, 2, 2);
+      }
+    }
+    entity_handle player = g.add_object(species::player, 50, 50, 10, 10);
+    entity_handle dog = g.add_object(species::dog, 64, 0);
+    g.set_target(dog, player, 64);
+  }
+
+  bool same_state(const ground &a, const ground &b)
+  {
+    const entity_store &x = a.entities();
+    const entity_store &y = b.entities();
+    return x.kind == y.kind && x.x_pos == y.x_pos && x.y_pos == y.y_pos &&
+           x.x_vel == y.x_vel && x.y_vel == y.y_vel && x.starves_at == y.starves_at;
+  }
+} // namespace
+
+int main(int argc, char *argv[])
+{
+  unsigned n_sheep = argc > 1 ? std::stoul(argv[1]) : 300;
+  unsigned n_wolf = argc > 2 ? std::stoul(argv[2]) : 5;
+  unsigned steps = argc > 3 ? std::stoul(argv[3]) : 1000;
+  unsigned threads = argc > 4 ? std::stoul(argv[4]) : 0;
+
+  ground per_species{NULL, threads};
+  ground per_entity{NULL, threads};
+  per_entity.set_dispatch(dispatch::per_entity);
+  populate(per_species, n_sheep, n_wolf);
+  populate(per_entity, n_sheep, n_wolf);
+
+  // Step by step in turns, so that both see the same machine load
+  std::chrono::steady_clock::duration per_species_time{}, per_entity_time{};
+  for (unsigned step = 0; step < steps; step++)
+  {
+    auto start = std::chrono::steady_clock::now();
+    per_species.step();
+    auto middle = std::chrono::steady_clock::now();
+    per_entity.step();
+    auto end = std::chrono::steady_clock::now();
+    per_species_time += middle - start;
+    per_entity_time += end - middle;
+  }
+
+  auto ms = [](std::chrono::steady_clock::duration d) { return std::chrono::duration<double, std::milli>(d).count(); };
+  std::cout << n_sheep << " sheep, " << n_wolf << " wolves, " << steps << " steps ("
+            << per_species.size() << " entities left)" << std::endl;
+  std::cout << "  one pass per species: " << ms(per_species.decision_time()) << " ms deciding, "
+            << ms(per_species_time) << " ms stepping" << std::endl;
+  std::cout << "  switch per entity:    " << ms(per_entity.decision_time()) << " ms deciding, "
+            << ms(per_entity_time) << " ms stepping" << std::endl;
+
+  if (!same_state(per_species, per_entity))
+  {
+    std::cout << "The two dispatches reached different states" << std::endl;
+    return 1;
+  }
+  return 0;
+}
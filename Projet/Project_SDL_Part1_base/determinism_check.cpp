@@ -0,0 +1,90 @@
+#include "Project_SDL1.h"
+#include <string>
+
+// Checks that a seeded ground steps to the same state whatever the number
+// of threads of its job system: runs it headless (no SDL video) with one
+// thread and with several, and compares a hash of every entity's state
+// after each of a few checkpoints. Exits nonzero on a mismatch.
+
+namespace
+{
+  constexpr unsigned n_sheep = 200;
+  constexpr unsigned n_wolf = 8;
+  constexpr unsigned steps = 1500;
+  constexpr unsigned checkpoints = 5;
+  // Where the application places animals: the window less a sprite
+  constexpr std::uint32_t area_width = 640 - 64;
+  constexpr std::uint32_t area_height = 480 - 64;
+
+  // FNV-1a over the components that the systems update
+  std::uint64_t state_hash(const ground &g)
+  {
+    std::uint64_t hash = 1469598103934665603ull;
+    auto mix = [&hash](std::uint64_t value) { hash = (hash ^ value) * 1099511628211ull; };
+
+    const entity_store &es = g.entities();
+    mix(g.clock().tick());
+    mix(es.size());
+    for (entity e = 0; e < es.size(); e++)
+    {
+      mix(static_cast<std::uint64_t>(es.kind[e]));
+      mix(static_cast<std::uint32_t>(es.x_pos[e]));
+      mix(static_cast<std::uint32_t>(es.y_pos[e]));
+      mix(static_cast<std::uint32_t>(es.x_vel[e]));
+      mix(static_cast<std::uint32_t>(es.y_vel[e]));
+      mix(es.properties[e].bits());
+      mix(es.starves_at[e]);
+    }
+    return hash;
+  }
+
+  // The hashes of a run at each checkpoint, placed as application does
+  std::vector<std::uint64_t> run(unsigned threads, std::uint64_t seed)
+  {
+    ground g{NULL, threads, seed};
+    const counter_rng &rng = g.rng();
+    for (unsigned i = 0; i < n_sheep + n_wolf; i++)
+    {
+      int x_pos = rng.below(area_width, i, 0, random_draw::place_x);
+      int y_pos = rng.below(area_height, i, 0, random_draw::place_y);
+      g.add_object(i < n_sheep ? species::sheep : species::wolf, x_pos, y_pos);
+    }
+    entity_handle player = g.add_object(species::player, area_width / 2, area_height / 2);
+    entity_handle dog = g.add_object(species::dog, area_width / 2, area_height / 2);
+    g.set_target(dog, player, 128);
+
+    std::vector<std::uint64_t> hashes;
+    for (unsigned checkpoint = 0; checkpoint < checkpoints; checkpoint++)
+    {
+      for (unsigned step = 0; step < steps / checkpoints; step++)
+      {
+        g.step();
+      }
+      hashes.push_back(state_hash(g));
+    }
+    return hashes;
+  }
+} // namespace
+
+int main(int argc, char *argv[])
+{
+  std::uint64_t seed = argc > 1 ? std::stoull(argv[1]) : 0;
+
+  std::vector<std::uint64_t> reference = run(1, seed);
+  for (unsigned threads : {2u, 3u, 8u})
+  {
+    std::vector<std::uint64_t> hashes = run(threads, seed);
+    for (unsigned checkpoint = 0; checkpoint < checkpoints; checkpoint++)
+    {
+      if (hashes[checkpoint] != reference[checkpoint])
+      {
+        std::cout << "Seed " << seed << ": " << threads << " threads diverge from 1 thread by step "
+                  << (checkpoint + 1) * (steps / checkpoints) << std::endl;
+        return 1;
+      }
+    }
+  }
+
+  std::cout << "Seed " << seed << ": same state with 1, 2, 3 and 8 threads" << std::endl;
+  return 0;
+}
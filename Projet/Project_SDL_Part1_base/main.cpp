@@ -7,18 +7,38 @@ int main(int argc, char *argv[])
 
   std::cout << "Starting up the application" << std::endl;
 
-  if (argc != 4)
+  bool headless = false;
+  std::uint64_t seed = 0;
+  double tick_rate = default_tick_rate;
+  bool options_ok = argc >= 4;
+  for (int i = 4; i < argc; i++)
+  {
+    std::string option = argv[i];
+    if (option == "--headless")
+      headless = true;
+    else if (option.rfind("--seed=", 0) == 0)
+      seed = std::stoull(option.substr(7));
+    else if (option.rfind("--tick-rate=", 0) == 0)
+      tick_rate = std::stod(option.substr(12));
+    else
+      options_ok = false;
+  }
+  if (!(tick_rate > 0))
+    options_ok = false;
+
+  if (!options_ok)
     throw std::runtime_error("Need three arguments - "
                              "number of sheep, number of wolves, "
-                             "simulation time\n");
+                             "simulation time - and optionally --headless, "
+                             "--seed=<n> and --tick-rate=<steps per second>\n");
 
-  init();
+  init(headless);
 
   std::cout << "Done with initilization" << std::endl;
 
-  application my_app(std::stoul(argv[1]), std::stoul(argv[2]));
+  application my_app(std::stoul(argv[1]), std::stoul(argv[2]), headless, seed, tick_rate);
 
-  std::cout << "Created window" << std::endl;
+  std::cout << (headless ? "Running headless" : "Created window") << std::endl;
 
   int retval = my_app.loop(std::stoul(argv[3]));
 
@@ -27,4 +47,4 @@ int main(int argc, char *argv[])
   SDL_Quit();
 
   return retval;
-}
\ No newline at end of file
+}
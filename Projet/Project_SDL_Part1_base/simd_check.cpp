@@ -0,0 +1,155 @@
+#include "Project_SDL1.h"
+#include <random>
+#include <vector>
+
+// Checks the batched kernels against their scalar path on random inputs:
+// a range of one entity always takes the scalar tail, so calling the
+// kernel entity by entity gives the reference results. Built once per
+// instruction set (see CMakeLists.txt), exits nonzero on a mismatch.
+
+namespace
+{
+  constexpr std::size_t rounds = 200;
+  constexpr std::size_t max_count = 67; // several batches and a tail
+  constexpr int extent = 1000;          // past the borders, to bounce
+
+  bool check_movement(std::mt19937 &gen)
+  {
+    std::uniform_int_distribution<int> x_dist(-extent / 10, extent);
+    std::uniform_int_distribution<int> y_dist(-extent / 10, extent);
+    std::uniform_int_distribution<int> vel_dist(-8, 8);
+    std::uniform_int_distribution<int> move_dist(0, 2);
+    std::uniform_int_distribution<std::size_t> count_dist(0, max_count);
+
+    std::size_t count = count_dist(gen);
+    std::vector<int> x_pos(count), y_pos(count), x_vel(count), y_vel(count);
+    std::vector<int> target_x(count), target_y(count);
+    std::vector<movement> moves(count);
+    for (std::size_t e = 0; e < count; e++)
+    {
+      x_pos[e] = x_dist(gen);
+      y_pos[e] = y_dist(gen);
+      x_vel[e] = vel_dist(gen);
+      y_vel[e] = vel_dist(gen);
+      moves[e] = static_cast<movement>(move_dist(gen));
+      // Some already on their target
+      bool reached = move_dist(gen) == 0;
+      target_x[e] = reached ? x_pos[e] : x_dist(gen);
+      target_y[e] = reached ? y_pos[e] : y_dist(gen);
+    }
+
+    std::vector<int> x_batch = x_pos, y_batch = y_pos, x_vel_batch = x_vel, y_vel_batch = y_vel;
+    integrate_movement(x_batch.data(), y_batch.data(), x_vel_batch.data(), y_vel_batch.data(),
+                       moves.data(), target_x.data(), target_y.data(), 0, count);
+    for (std::size_t e = 0; e < count; e++)
+    {
+      integrate_movement(x_pos.data(), y_pos.data(), x_vel.data(), y_vel.data(),
+                         moves.data(), target_x.data(), target_y.data(), e, e + 1);
+    }
+
+    for (std::size_t e = 0; e < count; e++)
+    {
+      if (x_batch[e] != x_pos[e] || y_batch[e] != y_pos[e] ||
+          x_vel_batch[e] != x_vel[e] || y_vel_batch[e] != y_vel[e])
+      {
+        std::cout << "integrate_movement: entity " << e << " of " << count
+                  << " at (" << x_batch[e] << ", " << y_batch[e] << ") batched, ("
+                  << x_pos[e] << ", " << y_pos[e] << ") alone" << std::endl;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool check_nearest(std::mt19937 &gen)
+  {
+    // Coordinates over the whole narrow range, ties made likely by a few
+    // duplicated points
+    std::uniform_int_distribution<int> coord_dist(-16384, 16383);
+    std::uniform_int_distribution<std::uint32_t> tag_dist(0, 3);
+    std::uniform_int_distribution<std::size_t> count_dist(0, max_count);
+
+    std::size_t count = count_dist(gen);
+    std::vector<int> x_pos(count), y_pos(count);
+    std::vector<tag_set> properties(count);
+    std::vector<entity> ids(count);
+    for (std::size_t e = 0; e < count; e++)
+    {
+      bool duplicate = e > 0 && tag_dist(gen) == 0;
+      x_pos[e] = duplicate ? x_pos[e - 1] : coord_dist(gen);
+      y_pos[e] = duplicate ? y_pos[e - 1] : coord_dist(gen);
+      std::uint32_t kind = tag_dist(gen);
+      properties[e] = kind == 0 ? tag_set{tag::sheep} : kind == 1 ? tag_set{tag::wolf} : tag_set{tag::dog, tag::player};
+      ids[e] = static_cast<entity>(count - e); // not sorted, so that ties pick by id
+    }
+
+    int x = coord_dist(gen);
+    int y = coord_dist(gen);
+    std::uint32_t kind = tag_dist(gen);
+    tag_set object_types = kind == 0 ? tag_set{} : kind == 1 ? tag_set{tag::sheep} : tag_set{tag::wolf, tag::player};
+    entity skip = count > 0 && tag_dist(gen) == 0 ? ids[tag_dist(gen) % count] : no_entity;
+
+    entity batch_best = no_entity;
+    std::int64_t batch_dist2 = 0;
+    nearest_point(x_pos.data(), y_pos.data(), properties.data(), ids.data(), 0, count, x, y,
+                  object_types, skip, true, batch_best, batch_dist2);
+
+    entity alone_best = no_entity;
+    std::int64_t alone_dist2 = 0;
+    for (std::size_t e = 0; e < count; e++)
+    {
+      nearest_point(x_pos.data(), y_pos.data(), properties.data(), ids.data(), e, e + 1, x, y,
+                    object_types, skip, true, alone_best, alone_dist2);
+    }
+
+    entity brute_best = no_entity;
+    std::int64_t brute_dist2 = 0;
+    for (std::size_t e = 0; e < count; e++)
+    {
+      if (ids[e] == skip || (!object_types.empty() && !properties[e].intersects(object_types)))
+      {
+        continue;
+      }
+      std::int64_t dx = x_pos[e] - x;
+      std::int64_t dy = y_pos[e] - y;
+      std::int64_t dist2 = dx * dx + dy * dy;
+      if (brute_best == no_entity || dist2 < brute_dist2 || (dist2 == brute_dist2 && ids[e] < brute_best))
+      {
+        brute_best = ids[e];
+        brute_dist2 = dist2;
+      }
+    }
+
+    if (batch_best != alone_best || batch_best != brute_best ||
+        (batch_best != no_entity && (batch_dist2 != alone_dist2 || batch_dist2 != brute_dist2)))
+    {
+      std::cout << "nearest_point: " << count << " points, entity " << batch_best << " batched, "
+                << alone_best << " alone, " << brute_best << " by brute force" << std::endl;
+      return false;
+    }
+    return true;
+  }
+} // namespace
+
+int main(int argc, char *argv[])
+{
+#if defined(__AVX2__) && !defined(NO_SIMD) && (defined(__GNUC__) || defined(__clang__))
+  if (!__builtin_cpu_supports("avx2"))
+  {
+    std::cout << "AVX2 not supported here, skipped" << std::endl;
+    return 0;
+  }
+#endif
+
+  std::mt19937 gen{argc > 1 ? static_cast<std::mt19937::result_type>(std::stoul(argv[1])) : 0u};
+  for (std::size_t round = 0; round < rounds; round++)
+  {
+    if (!check_movement(gen) || !check_nearest(gen))
+    {
+      return 1;
+    }
+  }
+
+  std::cout << "Batched kernels match their scalar path" << std::endl;
+  return 0;
+}